@@ -1,6 +1,8 @@
 #include "umem.h"
 #include "umem.c"
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
 void basic_first_fit_test()
 {
@@ -653,6 +655,1427 @@ void realloc_stress_test()
     printf("\n");
 }
 
+void heap_profile_test()
+{
+    /*
+     * function: heap_profile_test
+     * ----------------------------
+     * tests the sampling heap profiler.
+     *
+     * test cases:
+     * 1. many small allocations from two call sites
+     *    - tests that samples are taken roughly every 256 bytes
+     *    - verifies both sites show up in the profile
+     *
+     * 2. freeing one site's blocks
+     *    - tests that live counts drop while cumulative counts stay
+     *
+     * expected behavior:
+     * - should print a legacy pprof heap profile
+     * - freed site should show 0 live objects, the other all 16
+     */
+    printf("\n=== Testing Heap Profiling ===\n");
+    umeminit(65536, FIRST_FIT);
+    umem_prof_set_rate(256);
+
+    // test 1: two call sites
+    void *small[64];
+    void *large[16];
+    for (int i = 0; i < 64; i++)
+    {
+        small[i] = umalloc(40);
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        large[i] = umalloc(1000);
+    }
+
+    // test 2: free the small blocks only
+    for (int i = 0; i < 64; i++)
+    {
+        ufree(small[i]);
+    }
+
+    umem_prof_dump(stdout);
+    umem_prof_set_rate(0);
+    for (int i = 0; i < 16; i++)
+    {
+        ufree(large[i]);
+    }
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+static void size_index_picks(int algo, long picks[3])
+{
+    // the size index test's sequence; where each probe landed, from the start of the region
+    umeminit(4096, algo);
+
+    // test 1: holes of different sizes
+    void *ptrs[12];
+    for (int i = 0; i < 12; i++)
+    {
+        ptrs[i] = umalloc(32 + (i % 4) * 40);
+    }
+    for (int i = 0; i < 12; i += 2)
+    {
+        ufree(ptrs[i]);
+    }
+    picks[0] = (char *)umalloc(60) - region_start;  // should land in a 72 byte hole
+    picks[1] = (char *)umalloc(100) - region_start; // should land in a 112 byte hole
+
+    // test 2: merge holes back together
+    for (int i = 1; i < 12; i += 2)
+    {
+        ufree(ptrs[i]);
+    }
+    picks[2] = (char *)umalloc(600) - region_start;
+}
+
+void size_index_test()
+{
+    /*
+     * function: size_index_test
+     * ----------------------------
+     * tests fit searches through the packed free block size index.
+     *
+     * test cases:
+     * 1. fragmented free list
+     *    - frees every other block so the index holds many entries
+     *    - tests that best fit picks the smallest hole that fits
+     *
+     * 2. allocation after coalescing
+     *    - frees neighbours so entries merge and drop out of the index
+     *    - tests that the index follows the free list
+     *
+     * expected behavior:
+     * - every request should land where the plain best-fit list walk puts it
+     */
+    printf("\n=== Testing BEST_FIT with Size Index ===\n");
+    long list_picks[3], index_picks[3];
+    size_index_picks(BEST_FIT, list_picks);
+    reset_values();
+    size_index_picks(BEST_FIT | UMEM_SIZE_INDEX, index_picks);
+    int same = 1;
+    for (int i = 0; i < 3; i++)
+    {
+        same = same && index_picks[i] == list_picks[i];
+    }
+    printf("Same blocks as the list walk: %s\n", same ? "yes" : "no");
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+void small_bitmap_test()
+{
+    /*
+     * function: small_bitmap_test
+     * ----------------------------
+     * tests the headerless bitmap runs used for small requests.
+     *
+     * test cases:
+     * 1. many tiny allocations of two sizes
+     *    - tests that each size class gets its own run
+     *    - verifies slots are handed out without headers
+     *
+     * 2. freeing and reusing slots
+     *    - tests that freed slots are found again through the bitmaps
+     *
+     * 3. realloc past the small limit
+     *    - tests that the block moves to the list policies
+     *
+     * expected behavior:
+     * - large requests should still use the fit policy
+     * - the free list should only hold the space around the runs
+     */
+    printf("\n=== Testing Small Block Bitmap Runs ===\n");
+    umeminit(65536, FIRST_FIT | UMEM_SMALL_BITMAP);
+
+    // test 1: two size classes
+    void *tiny[100];
+    void *small[50];
+    for (int i = 0; i < 100; i++)
+    {
+        tiny[i] = umalloc(24);
+    }
+    for (int i = 0; i < 50; i++)
+    {
+        small[i] = umalloc(200);
+    }
+
+    // test 2: free half and allocate again
+    for (int i = 0; i < 100; i += 2)
+    {
+        ufree(tiny[i]);
+    }
+    for (int i = 0; i < 100; i += 2)
+    {
+        tiny[i] = umalloc(20);
+    }
+
+    // test 3: grow out of the small range
+    small[0] = urealloc(small[0], 1000);
+    void *large = umalloc(2048);
+    printf("Large request has a list header: %s\n",
+           large != NULL && ((header_t *)large - 1)->magic == MAGIC ? "yes" : "no");
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+void quick_bins_test()
+{
+    /*
+     * function: quick_bins_test
+     * ----------------------------
+     * tests deferred coalescing through the quick bins.
+     *
+     * test cases:
+     * 1. tight allocate/free loop of one size
+     *    - tests that the freed block is reused from its bin
+     *    - verifies no split or merge happens in between
+     *
+     * 2. request larger than any single hole
+     *    - tests that pressure merges the parked blocks back
+     *
+     * expected behavior:
+     * - loop should keep reusing the same address
+     * - large request should succeed after consolidation
+     */
+    printf("\n=== Testing Quick Bins ===\n");
+    umeminit(4096, FIRST_FIT | UMEM_QUICK_BINS);
+
+    // test 1: same size over and over
+    void *first = umalloc(100);
+    ufree(first);
+    int reused = 1;
+    for (int i = 0; i < 50; i++)
+    {
+        void *ptr = umalloc(100);
+        reused = reused && ptr == first;
+        ufree(ptr);
+    }
+    printf("Bin reuse kept the same block: %s\n", reused ? "yes" : "no");
+
+    // test 2: fill with small blocks, free them all, ask for most of the region
+    void *ptrs[20];
+    for (int i = 0; i < 20; i++)
+    {
+        ptrs[i] = umalloc(150);
+    }
+    for (int i = 0; i < 20; i++)
+    {
+        ufree(ptrs[i]);
+    }
+    void *large = umalloc(3500);
+    printf("Large request after consolidation: %s\n", large != NULL ? "succeeded" : "failed");
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+void compaction_test()
+{
+    /*
+     * function: compaction_test
+     * ----------------------------
+     * tests movable allocations and heap compaction.
+     *
+     * test cases:
+     * 1. the fragmentation_test pattern through handles
+     *    - alternating 256 and 64 byte handles, every other one freed
+     *    - tests that a 512 byte request fails while space is scattered
+     *
+     * 2. compaction with one pinned block
+     *    - tests that unpinned blocks slide together and keep their data
+     *    - verifies the pinned block stays where it is
+     *
+     * expected behavior:
+     * - 512 byte request should succeed after compaction
+     * - handle contents should survive the move
+     */
+    printf("\n=== Testing Handles and Compaction ===\n");
+    umeminit(4096, BEST_FIT);
+
+    // test 1: alternating sizes, free every other one
+    umem_handle_t handles[10];
+    for (int i = 0; i < 10; i++)
+    {
+        handles[i] = umem_halloc(i % 2 == 1 ? 64 : 256);
+        char *data = umem_hlock(handles[i]);
+        data[0] = 'a' + i;
+        umem_hunlock(handles[i]);
+    }
+    for (int i = 0; i < 10; i += 2)
+    {
+        umem_hfree(handles[i]);
+    }
+    void *large_fail = umalloc(3000);
+    printf("Large request before compaction: %s\n", large_fail ? "succeeded" : "failed");
+
+    // test 2: pin one block, compact, check the data
+    char *pinned = umem_hlock(handles[1]);
+    size_t largest = umem_compact();
+    umem_hunlock(handles[1]);
+    printf("Largest free block after compaction: %zu bytes\n", largest);
+    int intact = 1;
+    for (int i = 1; i < 10; i += 2)
+    {
+        char *data = umem_hlock(handles[i]);
+        intact = intact && data[0] == 'a' + i;
+        umem_hunlock(handles[i]);
+    }
+    printf("Handle data intact: %s, pinned block stayed: %s\n", intact ? "yes" : "no",
+           pinned == umem_hlock(handles[1]) ? "yes" : "no");
+    umem_hunlock(handles[1]);
+
+    void *large = umalloc(3000);
+    printf("Large request after compaction: %s\n", large ? "succeeded" : "failed");
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+void adaptive_policy_test()
+{
+    /*
+     * function: adaptive_policy_test
+     * ----------------------------
+     * tests runtime policy switching driven by fragmentation and search cost.
+     *
+     * test cases:
+     * 1. churn on a nearly empty heap
+     *    - tests that a mostly free region moves to worst fit
+     *
+     * 2. fragmenting phase
+     *    - interleaves long-lived and freed blocks of mixed sizes
+     *    - tests that high fragmentation moves the heap to best fit
+     *
+     * expected behavior:
+     * - should print the policy after each phase
+     * - should only switch after several windows agree
+     */
+    printf("\n=== Testing Adaptive Policy Selection ===\n");
+    umeminit(65536, FIRST_FIT | UMEM_ADAPTIVE);
+
+    // test 1: allocate and free right away
+    for (int i = 0; i < 1024; i++)
+    {
+        ufree(umalloc(64));
+    }
+    printf("Policy after churn: %d\n", umem_policy());
+
+    // test 2: keep every other block of a mixed-size pattern
+    void *ptrs[400];
+    for (int i = 0; i < 400; i++)
+    {
+        ptrs[i] = umalloc(16 + (i * 37) % 200);
+    }
+    for (int i = 0; i < 400; i += 2)
+    {
+        ufree(ptrs[i]);
+    }
+    for (int i = 0; i < 1024; i++)
+    {
+        ufree(umalloc(8 + (i * 53) % 120));
+    }
+    printf("Policy after fragmenting: %d\n", umem_policy());
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+#define HANDOFF_BLOCKS 2000
+
+static void *handoff[HANDOFF_BLOCKS];
+static atomic_int handoff_ready = 0;
+
+static void *consumer_thread(void *arg)
+{
+    (void)arg;
+    // free everything the producer hands over, from a thread that doesn't own the heap
+    for (int i = 0; i < HANDOFF_BLOCKS; i++)
+    {
+        while (atomic_load(&handoff_ready) <= i)
+        {
+        }
+        ufree(handoff[i]);
+    }
+    return NULL;
+}
+
+void cross_thread_free_test()
+{
+    /*
+     * function: cross_thread_free_test
+     * ----------------------------
+     * tests frees from a thread that doesn't own the heap.
+     *
+     * test cases:
+     * 1. producer/consumer handoff
+     *    - main thread allocates, a second thread frees every block
+     *    - tests that remote frees are queued without the heap lock
+     *
+     * 2. draining the queue
+     *    - main thread keeps allocating and picks the queued blocks up
+     *
+     * expected behavior:
+     * - allocations should equal deallocations once drained
+     * - the region should be one free block again
+     */
+    printf("\n=== Testing Cross-Thread Frees ===\n");
+    umeminit(65536, FIRST_FIT | UMEM_THREADED);
+
+    // test 1: hand blocks over to the consumer as they are allocated
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, consumer_thread, NULL);
+    for (int i = 0; i < HANDOFF_BLOCKS; i++)
+    {
+        handoff[i] = umalloc(16 + i % 100);
+        while (handoff[i] == NULL)
+        {
+            handoff[i] = umalloc(16 + i % 100); // wait for remote frees to come back
+        }
+        atomic_store(&handoff_ready, i + 1);
+    }
+    pthread_join(consumer, NULL);
+
+    // test 2: the next call drains whatever is still queued
+    ufree(umalloc(8));
+    printf("Region back in one piece: %s\n",
+           list_head != NULL && list_head->size == 65536 && list_head->next == NULL ? "yes" : "no");
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+#define HEAP_FILE "umem_test.heap"
+
+// user data in the file is reached through the root, so it holds no
+// pointers of its own
+typedef struct
+{
+    int count;
+    int ids[8];
+} record_table_t;
+
+void file_heap_test()
+{
+    /*
+     * function: file_heap_test
+     * ----------------------------
+     * tests a heap kept in a file across restarts.
+     *
+     * test cases:
+     * 1. clean reopen
+     *    - fills a table hung off the root, closes the heap
+     *    - reopens the file and reads the table back
+     *
+     * 2. crash recovery
+     *    - a child process allocates and exits without umem_close
+     *    - the next open rebuilds the free list from the blocks
+     *
+     * expected behavior:
+     * - the table and stats should come back after a clean close
+     * - after the crash the child's block counts as allocated and the
+     *   rest of the region is free
+     */
+    printf("\n=== Testing File-Backed Heap ===\n");
+    unlink(HEAP_FILE);
+
+    // test 1: fill a table, close, reopen and read it back
+    umeminit_file(HEAP_FILE, 4096, FIRST_FIT);
+    void *hole = umalloc(64);
+    record_table_t *table = umalloc(sizeof(record_table_t));
+    umalloc(32);
+    ufree(hole); // leave a hole in front of the table
+    table->count = 3;
+    for (int i = 0; i < table->count; i++)
+    {
+        table->ids[i] = i * 10;
+    }
+    umem_set_root(table);
+    umem_close();
+
+    umeminit_file(HEAP_FILE, 0, FIRST_FIT);
+    table = umem_get_root();
+    printf("Records after reopen:");
+    for (int i = 0; table != NULL && i < table->count; i++)
+    {
+        printf(" %d", table->ids[i]);
+    }
+    printf("\n");
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    umem_close();
+
+    // test 2: a process that dies with the heap open
+    pid_t child = fork();
+    if (child == 0)
+    {
+        umeminit_file(HEAP_FILE, 0, FIRST_FIT);
+        umalloc(100);
+        _exit(0);
+    }
+    waitpid(child, NULL, 0);
+
+    umeminit_file(HEAP_FILE, 0, FIRST_FIT);
+    printf("Recovered heap:\n");
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    umem_close();
+    unlink(HEAP_FILE);
+
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+#define SHARED_HEAP "/umem_test_heap"
+#define SHARED_WORKERS 4
+
+void shared_heap_test()
+{
+    /*
+     * function: shared_heap_test
+     * ----------------------------
+     * tests a heap shared between processes.
+     *
+     * test cases:
+     * 1. concurrent workers
+     *    - parent creates the heap, forked workers attach to it by name
+     *    - each worker allocates and frees under the shared lock
+     *
+     * 2. zero-copy handoff
+     *    - each worker leaves a message block and publishes its offset
+     *      in a table hung off the root
+     *    - parent reads the messages in place and frees them
+     *
+     * expected behavior:
+     * - every worker's message should arrive intact
+     * - the region should be one free block again at the end
+     */
+    printf("\n=== Testing Shared Heap ===\n");
+    shm_unlink(SHARED_HEAP);
+    umeminit_shared(SHARED_HEAP, 65536, FIRST_FIT);
+    long *outbox = umalloc(SHARED_WORKERS * sizeof(long));
+    umem_set_root(outbox);
+
+    // test 1: workers churn the heap at the same time
+    for (int w = 0; w < SHARED_WORKERS; w++)
+    {
+        if (fork() == 0)
+        {
+            // attach the way an unrelated process would
+            umem_close();
+            umeminit_shared(SHARED_HEAP, 0, FIRST_FIT);
+            void *blocks[100];
+            for (int round = 0; round < 20; round++)
+            {
+                for (int i = 0; i < 100; i++)
+                {
+                    blocks[i] = umalloc(16 + (i * 7 + w) % 120);
+                }
+                for (int i = 0; i < 100; i++)
+                {
+                    ufree(blocks[i]);
+                }
+            }
+
+            // test 2: leave a message behind and publish where it is
+            char *message = umalloc(32);
+            snprintf(message, 32, "hello from worker %d", w);
+            long *table = umem_get_root();
+            table[w] = umem_offset(message);
+            _exit(0);
+        }
+    }
+    for (int w = 0; w < SHARED_WORKERS; w++)
+    {
+        wait(NULL);
+    }
+
+    for (int w = 0; w < SHARED_WORKERS; w++)
+    {
+        char *message = umem_pointer(outbox[w]);
+        printf("%s\n", message);
+        ufree(message);
+    }
+    ufree(outbox);
+    printf("Region back in one piece: %s\n",
+           list_head != NULL && list_head->size == 65536 && list_head->next == NULL ? "yes" : "no");
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    umem_close();
+    shm_unlink(SHARED_HEAP);
+
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+static void print_block(void *block, size_t size, int state, void *arg)
+{
+    const char *names[] = {"free", "used", "parked", "run"};
+    printf("  %5ld %5zu %s\n", (long)((char *)block - (char *)arg), size, names[state]);
+}
+
+void heap_walk_test()
+{
+    /*
+     * function: heap_walk_test
+     * ----------------------------
+     * tests the heap walk and the heap map export.
+     *
+     * test cases:
+     * 1. walking a fragmented heap
+     *    - allocates five blocks and frees the second and fourth
+     *    - tests that every block is visited in address order
+     *
+     * 2. heap map
+     *    - dumps the region as CSV in 1024 byte cells
+     *
+     * expected behavior:
+     * - the walk should alternate used and free blocks, then end in the
+     *   free tail
+     * - every cell's used and free bytes should add up to 1024
+     */
+    printf("\n=== Testing Heap Walk and Map ===\n");
+    umeminit(4096, FIRST_FIT);
+
+    // test 1: used/free/used/free/used, then the tail; the canary counts
+    // toward the request so the layout is the same at every check level
+    void *blocks[5];
+    for (int i = 0; i < 5; i++)
+    {
+        blocks[i] = umalloc(200 + i * 100 - GUARD_BYTES);
+    }
+    ufree(blocks[1]);
+    ufree(blocks[3]);
+    printf("Blocks (offset size state):\n");
+    int visited = umem_walk(print_block, (char *)blocks[0] - sizeof(header_t));
+    printf("Blocks visited: %d\n", visited);
+
+    // test 2: the same heap as a map
+    umem_heap_map(stdout, 1024, UMEM_MAP_CSV);
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+void size_class_test()
+{
+    /*
+     * function: size_class_test
+     * ----------------------------
+     * tests size classes learned from the request mix.
+     *
+     * test cases:
+     * 1. odd request sizes
+     *    - a steady stream of 40, 72 and 200 byte requests, one in
+     *      twenty is 24 bytes
+     *    - before the first review they share the default 16 byte classes
+     *
+     * 2. after the review
+     *    - tests that the hot odd sizes got exact classes
+     *    - reports internal fragmentation with the old and new classes
+     *
+     * expected behavior:
+     * - 40, 72 and 200 should be dedicated, 24 is not hot enough
+     * - internal fragmentation should drop to what the 24s waste
+     */
+    printf("\n=== Testing Learned Size Classes ===\n");
+    umeminit(65536, FIRST_FIT | UMEM_SIZE_CLASSES);
+    size_t sizes[20] = {24};
+    for (int i = 1; i < 20; i++)
+    {
+        sizes[i] = i % 3 == 0 ? 40 : i % 3 == 1 ? 72 : 200;
+    }
+    void *live[16] = {NULL};
+
+    // test 1: before the first review
+    for (int i = 0; i < 4000; i++)
+    {
+        ufree(live[i % 16]);
+        live[i % 16] = umalloc(sizes[i % 20]);
+    }
+    printf("Before review:\n");
+    umem_class_report(stdout);
+
+    // test 2: past the review
+    for (int i = 4000; i < 6000; i++)
+    {
+        ufree(live[i % 16]);
+        live[i % 16] = umalloc(sizes[i % 20]);
+    }
+    printf("After review:\n");
+    umem_class_report(stdout);
+    for (int i = 0; i < 16; i++)
+    {
+        ufree(live[i]);
+    }
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+long steps_for_large_request(int algo, void **blocks, int count)
+{
+    // every other small block freed, so the free list is count / 2 long
+    umeminit(65536, algo);
+    for (int i = 0; i < count; i++)
+    {
+        blocks[i] = umalloc(64);
+    }
+    for (int i = 0; i < count; i += 2)
+    {
+        ufree(blocks[i]);
+    }
+    search_steps = 0;
+    blocks[0] = umalloc(4000);
+    return search_steps;
+}
+
+void tlsf_test()
+{
+    /*
+     * function: tlsf_test
+     * ----------------------------
+     * tests the two-level segregated fit policy.
+     *
+     * test cases:
+     * 1. bounded search
+     *    - 200 small holes in front of the large free block
+     *    - counts the free blocks inspected for a 4000 byte request under
+     *      first fit and under TLSF
+     *
+     * 2. coalescing
+     *    - frees the rest and checks the region merges back together
+     *
+     * expected behavior:
+     * - first fit should walk every hole, TLSF should look at one block
+     * - everything freed should leave no fragmentation
+     */
+    printf("\n=== Testing TLSF ===\n");
+    void *blocks[400];
+
+    // test 1: the same heap under both policies
+    long first_steps = steps_for_large_request(FIRST_FIT, blocks, 400);
+    reset_values();
+    long tlsf_steps = steps_for_large_request(TLSF, blocks, 400);
+    printf("Blocks inspected for a 4000 byte request: first fit %ld, TLSF %ld\n", first_steps, tlsf_steps);
+
+    // test 2: free the rest and let it merge
+    ufree(blocks[0]);
+    for (int i = 1; i < 400; i += 2)
+    {
+        ufree(blocks[i]);
+    }
+    calculate_fragmentation();
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+#define CACHE_WORKERS 4
+#define CACHE_ROUNDS 20000
+
+static void count_blocks(void *block, size_t size, int state, void *arg)
+{
+    (void)block;
+    (void)size;
+    ((int *)arg)[state]++;
+}
+
+static void *cache_worker(void *arg)
+{
+    // churn small blocks, each filled with its own size to spot overlaps
+    long *corrupt = arg;
+    unsigned long seed = (uintptr_t)arg;
+    unsigned char *held[64] = {NULL};
+    for (int i = 0; i < CACHE_ROUNDS; i++)
+    {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        int slot = (seed >> 33) % 64;
+        if (held[slot] != NULL)
+        {
+            size_t size = held[slot][0];
+            for (size_t j = 0; j < size; j++)
+            {
+                if (held[slot][j] != size)
+                {
+                    (*corrupt)++;
+                    break;
+                }
+            }
+            ufree(held[slot]);
+            held[slot] = NULL;
+        }
+        else
+        {
+            size_t size = 1 + (seed >> 40) % 200;
+            held[slot] = umalloc(size);
+            if (held[slot] != NULL)
+            {
+                memset(held[slot], (int)size, size);
+            }
+        }
+    }
+    for (int slot = 0; slot < 64; slot++)
+    {
+        ufree(held[slot]);
+    }
+    return NULL;
+}
+
+void percpu_cache_test()
+{
+    /*
+     * function: percpu_cache_test
+     * ----------------------------
+     * tests the per-CPU caches in front of the heap.
+     *
+     * test cases:
+     * 1. threads sharing the caches
+     *    - four threads allocate and free small blocks of mixed sizes
+     *    - each block is filled with its size and checked before the free
+     *
+     * 2. cache reuse
+     *    - one thread allocates and frees the same size over and over
+     *    - counts how often the cache had to be refilled from the heap
+     *
+     * 3. flush
+     *    - hands this CPU's cached blocks back to the heap
+     *
+     * expected behavior:
+     * - no block should be handed to two threads at once
+     * - freed blocks should sit in the caches, not count as in use
+     * - repeated requests should be served from the cache, with the heap
+     *   only visited for a refill
+     * - the totals count calls whether a cache served them or not
+     */
+    printf("\n=== Testing Per-CPU Caches ===\n");
+    umeminit(1 << 20, FIRST_FIT | UMEM_PERCPU);
+
+    // test 1: every worker frees what it allocated before it exits
+    long corrupt[CACHE_WORKERS] = {0};
+    pthread_t workers[CACHE_WORKERS];
+    for (int i = 0; i < CACHE_WORKERS; i++)
+    {
+        pthread_create(&workers[i], NULL, cache_worker, &corrupt[i]);
+    }
+    for (int i = 0; i < CACHE_WORKERS; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    int states[4] = {0};
+    umem_walk(count_blocks, states);
+    printf("Corrupted blocks: %ld\n", corrupt[0] + corrupt[1] + corrupt[2] + corrupt[3]);
+    printf("Blocks in use: %d, cached: %s\n", states[UMEM_BLOCK_USED], states[UMEM_BLOCK_PARKED] > 0 ? "yes" : "no");
+
+    // test 2: the same size round trip after the first refill
+    long refills = pcpu_refills;
+    for (int i = 0; i < 10000; i++)
+    {
+        ufree(umalloc(100));
+    }
+    printf("Heap refills for 10000 requests: %s\n", pcpu_refills - refills <= 4 ? "one per CPU at most" : "too many");
+
+    // test 3: the caller's cache goes back to the heap
+    states[UMEM_BLOCK_PARKED] = 0;
+    umem_walk(count_blocks, states);
+    int cached = states[UMEM_BLOCK_PARKED];
+    umem_cache_flush();
+    states[UMEM_BLOCK_PARKED] = 0;
+    umem_walk(count_blocks, states);
+    printf("Flush returned cached blocks: %s\n", states[UMEM_BLOCK_PARKED] < cached ? "yes" : "no");
+    printf("Every call counted: %s\n", num_allocs == num_deallocs ? "yes" : "no");
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+static int resident_pages(void *start, size_t length)
+{
+    // pages of the range the kernel currently backs with memory
+    unsigned char pages[256];
+    size_t count = length / 4096;
+    mincore(start, length, pages);
+    int resident = 0;
+    for (size_t i = 0; i < count && i < sizeof(pages); i++)
+    {
+        resident += pages[i] & 1;
+    }
+    return resident;
+}
+
+void background_test()
+{
+    /*
+     * function: background_test
+     * ----------------------------
+     * tests the maintenance thread that takes the work out of ufree.
+     *
+     * test cases:
+     * 1. queued frees
+     *    - frees 64 blocks, which only queues them
+     *    - asks for a block that needs all of them merged back
+     *
+     * 2. trimming
+     *    - fills a large block, frees it and waits for the thread
+     *    - checks the pages went back to the kernel
+     *
+     * expected behavior:
+     * - umalloc should drain the queue itself when it runs out of space
+     * - the thread should drain the rest and drop the large block's pages
+     */
+    printf("\n=== Testing Background Maintenance ===\n");
+    umeminit(1 << 20, FIRST_FIT | UMEM_BACKGROUND);
+
+    // test 1: the large request can only succeed once the queue is merged
+    void *blocks[64];
+    for (int i = 0; i < 64; i++)
+    {
+        blocks[i] = umalloc((1 << 20) / 64 - 64);
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        ufree(blocks[i]);
+    }
+    void *large = umalloc(900 * 1024);
+    printf("Large block after queued frees: %s\n", large != NULL ? "yes" : "no");
+
+    // test 2: touch every page, free, and give the thread time to trim
+    memset(large, 1, 900 * 1024);
+    int touched = resident_pages(region_start, 1 << 20);
+    ufree(large);
+    for (int i = 0; i < 200 && atomic_load(&remote_frees) != NULL; i++)
+    {
+        usleep(1000);
+    }
+    usleep(20000); // the pass that drained the queue trims after it
+    printf("Pages given back: %s\n", resident_pages(region_start, 1 << 20) < touched / 2 ? "yes" : "no");
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+static long block_stride(int algo)
+{
+    // distance between two 16 byte blocks allocated back to back, canary
+    // included
+    umeminit(65536, algo);
+    char *first = umalloc(16 - GUARD_BYTES);
+    char *second = umalloc(16 - GUARD_BYTES);
+    return second - first;
+}
+
+void out_of_band_test()
+{
+    /*
+     * function: out_of_band_test
+     * ----------------------------
+     * tests keeping block metadata in a table instead of in front of
+     * every block.
+     *
+     * test cases:
+     * 1. packing
+     *    - two 16 byte blocks back to back, with headers and with the table
+     *
+     * 2. reuse and merging
+     *    - frees every other block of 100, refills the holes, frees the rest
+     *    - walks the heap afterwards
+     *
+     * expected behavior:
+     * - blocks from the table should sit 16 bytes apart, with headers 32
+     * - the holes should be reused and everything should merge back into
+     *   one free block behind the table
+     */
+    printf("\n=== Testing Out-of-Band Metadata ===\n");
+
+    // test 1: the header's 16 bytes disappear from the payload area
+    long inline_stride = block_stride(FIRST_FIT);
+    reset_values();
+    long table_stride = block_stride(FIRST_FIT | UMEM_OUT_OF_BAND);
+    printf("Distance between 16 byte blocks: headers %ld, table %ld\n", inline_stride, table_stride);
+    reset_values();
+
+    // test 2: every other block freed, then the holes taken again
+    umeminit(65536, FIRST_FIT | UMEM_OUT_OF_BAND);
+    void *blocks[100];
+    for (int i = 0; i < 100; i++)
+    {
+        blocks[i] = umalloc(32);
+    }
+    for (int i = 0; i < 100; i += 2)
+    {
+        ufree(blocks[i]);
+    }
+    bool reused = true;
+    for (int i = 0; i < 100; i += 2)
+    {
+        void *ptr = umalloc(32);
+        reused = reused && ptr == blocks[i];
+        blocks[i] = ptr;
+    }
+    printf("Holes reused in place: %s\n", reused ? "yes" : "no");
+    for (int i = 0; i < 100; i++)
+    {
+        ufree(blocks[i]);
+    }
+    int states[5] = {0};
+    umem_walk(count_blocks, states);
+    printf("Blocks after freeing everything: %d table, %d free, %d used\n",
+           states[UMEM_BLOCK_META], states[UMEM_BLOCK_FREE], states[UMEM_BLOCK_USED]);
+    calculate_fragmentation();
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+void span_cache_test()
+{
+    /*
+     * function: span_cache_test
+     * ----------------------------
+     * tests reuse of empty bitmap runs across size classes.
+     *
+     * test cases:
+     * 1. retiring a run
+     *    - fills three runs with 16 byte slots, then frees them all
+     *    - the walk should show the two extra runs parked as empty spans
+     *
+     * 2. reuse by another class
+     *    - asks for 200 byte slots
+     *    - the new run should be one of the parked spans, recut
+     *
+     * 3. giving the runs back
+     *    - fills and empties four runs on a 32KB heap, then asks for 24000 bytes
+     *    - only fits once the empty runs go back to the region
+     *
+     * expected behavior:
+     * - frees find their run through the page map, with no header
+     * - the 200 byte run should not take a new block from the region
+     * - parked runs never keep a large request from being served
+     */
+    printf("\n=== Testing Span Cache ===\n");
+    umeminit(65536, FIRST_FIT | UMEM_SMALL_BITMAP);
+
+    // test 1: 3 runs of 256 slots, emptied again
+    void *slots[768];
+    for (int i = 0; i < 768; i++)
+    {
+        slots[i] = umalloc(16);
+    }
+    uintptr_t second_run = (uintptr_t)slots[256] & ~(RUN_SIZE - 1);
+    uintptr_t third_run = (uintptr_t)slots[512] & ~(RUN_SIZE - 1);
+    for (int i = 0; i < 768; i++)
+    {
+        ufree(slots[i]);
+    }
+    int states[5] = {0};
+    umem_walk(count_blocks, states);
+    printf("Runs in use: %d, parked: %d\n", states[UMEM_BLOCK_RUN], states[UMEM_BLOCK_PARKED]);
+
+    // test 2: a different class takes a parked span instead of new space
+    size_t free_before = current_free;
+    void *large_slot = umalloc(200);
+    uintptr_t large_run = (uintptr_t)large_slot & ~(RUN_SIZE - 1);
+    bool reused = large_run == second_run || large_run == third_run;
+    printf("Parked span reused for 200 byte slots: %s\n", reused && current_free == free_before ? "yes" : "no");
+    ufree(large_slot);
+    reset_values();
+
+    // test 3: the empty runs are all that stands between the request and the space
+    umeminit(32768, FIRST_FIT | UMEM_SMALL_BITMAP);
+    void *small[1024];
+    for (int i = 0; i < 1024; i++)
+    {
+        small[i] = umalloc(16);
+    }
+    for (int i = 0; i < 1024; i++)
+    {
+        ufree(small[i]);
+    }
+    void *big = umalloc(24000);
+    printf("24000 bytes after emptying the runs: %s\n", big != NULL ? "yes" : "no");
+    ufree(big);
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+void expand_in_place_test()
+{
+    /*
+     * function: expand_in_place_test
+     * ----------------------------
+     * tests umem_usable_size and umem_try_expand.
+     *
+     * test cases:
+     * 1. slack behind the payload
+     *    - takes a free block whose leftover is too small to split off
+     *    - the usable size should count the leftover bytes too
+     *
+     * 2. growing into a free neighbour
+     *    - frees the block right behind one, then expands it
+     *    - it should stop at the preferred size and keep its address
+     *
+     * 3. growing into a used neighbour
+     *    - the block behind is in use, so even the minimum can't be had
+     *
+     * expected behavior:
+     * - a failed expand returns 0 and leaves the block as it was
+     * - the data in an expanded block stays where it was
+     */
+    printf("\n=== Testing Expand In Place ===\n");
+    umeminit(4096, FIRST_FIT);
+
+    // test 1: a 100 byte hole handed out for 90 bytes keeps the rest
+    char *a = umalloc(100);
+    char *b = umalloc(100);
+    char *c = umalloc(100);
+    ufree(b);
+    b = umalloc(90);
+    printf("Asked for 90 bytes, usable: %zu\n", umem_usable_size(b));
+
+    // test 2: b's neighbour c goes away, b grows into part of its space
+    strcpy(b, "kept");
+    ufree(c);
+    size_t usable = umem_try_expand(b, 150, 200);
+    printf("Expanded to %zu bytes in place: %s, data: %s\n", usable,
+           usable == umem_usable_size(b) ? "yes" : "no", b);
+
+    // test 3: a's neighbour is b, which is in use
+    printf("Expand into a used block: %zu, usable still %zu\n",
+           umem_try_expand(a, 200, 200), umem_usable_size(a));
+
+    ufree(a);
+    ufree(b);
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+void placement_hint_test()
+{
+    /*
+     * function: placement_hint_test
+     * ----------------------------
+     * tests umalloc_hint placement.
+     *
+     * test cases:
+     * 1. long-lived blocks among short-lived churn
+     *    - interleaves long-lived and short-lived allocations
+     *    - long-lived ones should come from the top of the region
+     *
+     * 2. freeing the churn
+     *    - frees every short-lived block
+     *    - the free space should merge back into a single block
+     *
+     * 3. hot and cold blocks
+     *    - allocates hot blocks with cold ones in between
+     *    - each hot block should start where the previous one ended
+     *
+     * expected behavior:
+     * - without hints the long-lived blocks would split the free space
+     */
+    printf("\n=== Testing Placement Hints ===\n");
+    umeminit(8192, FIRST_FIT);
+
+    // test 1: every fourth block stays around
+    void *short_lived[12];
+    void *long_lived[4];
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            short_lived[i * 3 + j] = umalloc_hint(100, UMEM_SHORT_LIVED);
+        }
+        long_lived[i] = umalloc_hint(100, UMEM_LONG_LIVED);
+    }
+    bool on_top = true;
+    for (int i = 0; i < 4; i++)
+    {
+        on_top = on_top && (char *)long_lived[i] > (char *)short_lived[11];
+    }
+    printf("Long-lived blocks above the short-lived ones: %s\n", on_top ? "yes" : "no");
+
+    // test 2: the churn leaves no holes behind
+    for (int i = 0; i < 12; i++)
+    {
+        ufree(short_lived[i]);
+    }
+    int states[5] = {0};
+    umem_walk(count_blocks, states);
+    printf("Free blocks after the churn: %d\n", states[UMEM_BLOCK_FREE]);
+
+    // test 3: hot blocks stay together, cold ones go out of their way
+    char *hot[3];
+    void *cold[3];
+    for (int i = 0; i < 3; i++)
+    {
+        hot[i] = umalloc_hint(40, UMEM_HOT);
+        cold[i] = umalloc_hint(40, UMEM_COLD);
+    }
+    bool adjacent = true;
+    for (int i = 0; i < 2; i++)
+    {
+        header_t *hot_header = (header_t *)(hot[i] - sizeof(header_t));
+        adjacent = adjacent && hot[i] + hot_header->size == hot[i + 1];
+    }
+    printf("Hot blocks adjacent: %s\n", adjacent ? "yes" : "no");
+
+    for (int i = 0; i < 3; i++)
+    {
+        ufree(hot[i]);
+        ufree(cold[i]);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        ufree(long_lived[i]);
+    }
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+static void *span_worker(void *arg)
+{
+    // a handful of 24 byte counters, left allocated for the caller to check
+    void **blocks = arg;
+    for (int i = 0; i < 8; i++)
+    {
+        blocks[i] = umalloc(24);
+    }
+    return NULL;
+}
+
+void thread_spans_test()
+{
+    /*
+     * function: thread_spans_test
+     * ----------------------------
+     * tests the UMEM_THREAD_SPANS mode.
+     *
+     * test cases:
+     * 1. two threads allocating small blocks
+     *    - each thread allocates 8 counters of 24 bytes
+     *    - no 64 byte line should hold counters of both threads
+     *
+     * 2. a run left behind by a thread that exited
+     *    - the main thread allocates one more counter
+     *    - it should adopt one of the finished threads' runs, not cut a new one
+     *
+     * expected behavior:
+     * - 24 byte blocks are not padded to a line of their own
+     */
+    printf("\n=== Testing Thread Spans ===\n");
+    umeminit(65536, FIRST_FIT | UMEM_THREAD_SPANS);
+
+    // test 1: blocks of different threads never meet on a line
+    void *blocks[2][8];
+    pthread_t workers[2];
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_create(&workers[i], NULL, span_worker, blocks[i]);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    int shared_lines = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            uintptr_t first = (uintptr_t)blocks[0][i], second = (uintptr_t)blocks[1][j];
+            if (first / 64 == second / 64 || (first + 23) / 64 == (second + 23) / 64 ||
+                first / 64 == (second + 23) / 64 || (first + 23) / 64 == second / 64)
+            {
+                shared_lines++;
+            }
+        }
+    }
+    printf("Lines shared between threads: %d\n", shared_lines);
+    printf("Counters packed in one run: %s\n", (char *)blocks[0][7] - (char *)blocks[0][0] < 8 * 64 ? "yes" : "no");
+
+    // test 2: the main thread takes over a run whose thread is gone
+    size_t free_before = current_free;
+    uintptr_t counter = (uintptr_t)umalloc(24);
+    bool adopted = counter / RUN_SIZE == (uintptr_t)blocks[0][0] / RUN_SIZE ||
+                   counter / RUN_SIZE == (uintptr_t)blocks[1][0] / RUN_SIZE;
+    printf("Orphaned run adopted: %s\n", adopted && current_free == free_before ? "yes" : "no");
+
+    ufree((void *)counter);
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            ufree(blocks[i][j]);
+        }
+    }
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+void buffer_heap_test()
+{
+    /*
+     * function: buffer_heap_test
+     * ----------------------------
+     * tests umeminit_buffer on memory the caller owns.
+     *
+     * test cases:
+     * 1. a heap in static storage
+     *    - passes a misaligned pointer into a static array
+     *    - blocks should come from inside the array, 8 byte aligned
+     *
+     * 2. one heap after another
+     *    - closes the first heap, then sets up a table heap on a stack array
+     *    - the second heap should work on its own memory
+     *
+     * 3. a buffer too small for a single block
+     *    - should be refused, also when the block table alone would fill it
+     *
+     * expected behavior:
+     * - umem_close leaves the caller's memory in place
+     */
+    printf("\n=== Testing Buffer Heaps ===\n");
+    static char arena[8192];
+
+    // test 1: the pointer is trimmed to a granule, the rest is heap
+    umeminit_buffer(arena + 3, sizeof(arena) - 3, FIRST_FIT);
+    char *block = umalloc(104 - GUARD_BYTES); // 104 bytes with the canary, at any check level
+    printf("Block inside the array: %s, aligned: %s\n",
+           block >= arena && block + 96 <= arena + sizeof(arena) ? "yes" : "no",
+           ((uintptr_t)block & 7) == 0 ? "yes" : "no");
+    printf("Free after one block: %zu of %zu\n", current_free, sizeof(arena));
+    strcpy(block, "still here");
+    umem_close();
+
+    // test 2: a second heap, this time on the stack
+    char stack_buffer[4096];
+    umeminit_buffer(stack_buffer, sizeof(stack_buffer), BEST_FIT | UMEM_OUT_OF_BAND);
+    char *second = umalloc(200);
+    printf("Second heap on the stack: %s, first block kept: %s\n",
+           second >= stack_buffer && second < stack_buffer + sizeof(stack_buffer) ? "yes" : "no", block);
+    ufree(second);
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    umem_close();
+
+    // test 3: no room for anything
+    printf("Buffer of 8 bytes refused: %s\n", umeminit_buffer(arena, 8, FIRST_FIT) == -1 ? "yes" : "no");
+    printf("Table heap in 48 bytes refused: %s\n",
+           umeminit_buffer(arena, 48, BEST_FIT | UMEM_OUT_OF_BAND) == -1 ? "yes" : "no");
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
+#define METRICS_PAGE "/umem_test_metrics"
+
+void metrics_page_test()
+{
+    /*
+     * function: metrics_page_test
+     * ----------------------------
+     * tests the live metrics page.
+     *
+     * test cases:
+     * 1. counters seen from outside
+     *    - exports the page, runs 100 umalloc/ufree pairs
+     *    - maps the object read-only as an agent would and copies it out
+     *    - the counters should match the heap's
+     *
+     * 2. histograms
+     *    - every umalloc should land in one latency and one search bucket,
+     *      every ufree in one latency bucket
+     *    - a urealloc that shrinks in place should still update the page
+     *
+     * 3. stopping
+     *    - after umem_metrics_export(NULL) the page should stop moving
+     *
+     * expected behavior:
+     * - umem_metrics_read succeeds, no write is in flight single threaded
+     */
+    printf("\n=== Testing Metrics Page ===\n");
+    umeminit(65536, BEST_FIT);
+    umem_metrics_export(METRICS_PAGE);
+    for (int i = 0; i < 100; i++)
+    {
+        ufree(umalloc(64 + i));
+    }
+
+    // test 1: what an agent in another process would see
+    int fd = shm_open(METRICS_PAGE, O_RDONLY, 0);
+    const umem_metrics_t *page = mmap(NULL, sizeof(umem_metrics_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    umem_metrics_t seen;
+    int read = umem_metrics_read(page, &seen);
+    printf("Read: %s, allocs %ld, deallocs %ld, free %lu\n", read == 0 ? "ok" : "failed", seen.num_allocs,
+           seen.num_deallocs, seen.current_free);
+
+    // test 2: one histogram entry per call
+    unsigned long alloc_calls = 0, free_calls = 0, searches = 0;
+    for (int i = 0; i < UMEM_METRICS_BUCKETS; i++)
+    {
+        alloc_calls += seen.alloc_latency[i];
+        free_calls += seen.free_latency[i];
+        searches += seen.search_lengths[i];
+    }
+    printf("Latencies recorded: %lu umalloc, %lu ufree, search lengths: %lu\n", alloc_calls, free_calls, searches);
+    void *shrunk = urealloc(umalloc(1000), 200);
+    umem_metrics_read(page, &seen);
+    printf("Page follows urealloc: %s\n", seen.current_free == current_free ? "yes" : "no");
+    ufree(shrunk);
+
+    // test 3: nothing more gets published
+    umem_metrics_export(NULL);
+    ufree(umalloc(64));
+    umem_metrics_read(page, &seen);
+    printf("Allocs after stopping: %ld\n", seen.num_allocs);
+    munmap((void *)page, sizeof(umem_metrics_t));
+    shm_unlink(METRICS_PAGE);
+
+    printumemstats(num_allocs, num_deallocs, current_allocated, current_free, fragmentation);
+    printf("\n");
+    printf("=========================================");
+    printf("\n");
+}
+
 void double_free_test()
 {
 <<<<<<< HEAD
@@ -714,6 +2137,69 @@ int main()
     edge_case_tests();
     reset_values();
 
+    heap_profile_test();
+    reset_values();
+
+    size_index_test();
+    reset_values();
+
+    small_bitmap_test();
+    reset_values();
+
+    quick_bins_test();
+    reset_values();
+
+    compaction_test();
+    reset_values();
+
+    adaptive_policy_test();
+    reset_values();
+
+    cross_thread_free_test();
+    reset_values();
+
+    file_heap_test();
+    reset_values();
+
+    shared_heap_test();
+    reset_values();
+
+    heap_walk_test();
+    reset_values();
+
+    size_class_test();
+    reset_values();
+
+    tlsf_test();
+    reset_values();
+
+    percpu_cache_test();
+    reset_values();
+
+    background_test();
+    reset_values();
+
+    out_of_band_test();
+    reset_values();
+
+    span_cache_test();
+    reset_values();
+
+    expand_in_place_test();
+    reset_values();
+
+    placement_hint_test();
+    reset_values();
+
+    thread_spans_test();
+    reset_values();
+
+    buffer_heap_test();
+    reset_values();
+
+    metrics_page_test();
+    reset_values();
+
     double_free_test();
     return 0;
 }
\ No newline at end of file
@@ -1,678 +1,5272 @@
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <time.h>
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PCPU_RSEQ 1 // per-CPU caches run as restartable sequences
+#else
+#define PCPU_RSEQ 0
+#endif
 #include "umem.h"
 #define MIN_BLOCK_SIZE 32
+#define QUICK_MAGIC 0xFEEDFACELL // block parked in a quick bin
+#define REMOTE_MAGIC 0xC0FFEE11LL // block waiting in the remote free queue
+#define PCPU_MAGIC 0xCAC4EDLL    // block held in a per-CPU cache
+#define PROF_MAGIC 0x5A3B1EDLL   // live block the profiler sampled, under UMEM_PERCPU
+#define QUICK_MAX_BLOCK 512     // largest block size (header included) kept in a bin
+#define MAX_HANDLES 1024         // movable allocations live at once
+#define ADAPT_WINDOW 128         // allocations between policy reviews
+#define ADAPT_CONFIRM 3          // windows that must agree before switching
+#define ADAPT_FRAG_HIGH 40.0     // fragmentation % that calls for best fit
+#define ADAPT_FRAG_LOW 20.0      // and the level it must fall to before leaving it
+#define ADAPT_LONG_SEARCH 16     // average blocks inspected that counts as slow
+#define PCPU_STEP 16     // cached payload sizes are multiples of this
+#define PCPU_CLASSES 16  // so the caches take requests up to 256 bytes
+#define PCPU_MAX_SIZE (PCPU_STEP * PCPU_CLASSES)
+#define PCPU_DEPTH 32    // blocks a CPU keeps per class
+#define PCPU_BATCH 16    // blocks moved between a cache and the heap at once
+#define BACKGROUND_TICK_MS 5   // the maintenance thread runs at least this often
+#define BACKGROUND_BATCH 64    // queued frees that wake it early
+#define BACKGROUND_TRIM (1 << 16) // free blocks this large give their pages back
+#define PROF_MAX_DEPTH 32    // deepest stack kept per sample
+#define PROF_SITE_SLOTS 1024 // allocation sites (power of two)
+#define PROF_LIVE_SLOTS 4096 // sampled blocks still live (power of two)
+#define TLSF_SL_LOG2 4        // second level: 16 lists per power of two
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT 8       // sizes below 256 share the first level list
+#define TLSF_SMALL (1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT (64 - TLSF_FL_SHIFT + 1)
+#define SMALL_MAX_SIZE 256   // largest request served from bitmap runs
+#define SMALL_GRANULE 8      // slot sizes are multiples of this
+#define SMALL_STEP 16        // spacing of the default classes
+#define SMALL_CLASSES (SMALL_MAX_SIZE / SMALL_GRANULE)
+#define SMALL_REVIEW 4096    // small requests between size class reviews
+#define SMALL_HOT_SHARE 16   // a size with 1/16 of the requests is hot
+#define SMALL_DEDICATED 8    // most exact size classes at once
+#define RUN_SHIFT 12
+#define RUN_SIZE (1UL << RUN_SHIFT)
+#define RUN_WORDS (RUN_SIZE / SMALL_GRANULE / 64) // bitmap words for the smallest slots
+#define SPAN_CACHE_MAX 8 // empty runs kept for reuse by any class
+#define SPAN_RUN (1)     // span states: cut into slots of one class
+#define SPAN_CACHED (2)  // empty, waiting for the next class that needs a run
+#define SPAN_UNUSED (0)  // descriptor back in span_pool
+#define OOB_GRANULE 16                 // payload granule under UMEM_OUT_OF_BAND
+#define OOB_USED (1U << 31)            // table entry bits: block in use
+#define OOB_START (1U << 30)           // first granule of a block
+#define OOB_SINGLE (1U << 29)          // free one granule block, the rest is its link
+#define OOB_SIZE_MASK (OOB_SINGLE - 1) // size in granules, or a link
+#define OOB_NIL OOB_SIZE_MASK          // end of the free list
+#define FILE_MAGIC 0x554D454D46494C45LL // "UMEMFILE"
+#define FILE_VERSION 1
+#define FILE_HEADER_SIZE 4096 // the heap starts on the page after the file header
+#define SHARED_ATTACH_TRIES 1000 // 1ms waits for the creator to finish formatting
+#define GUARD_CANARY 0x5AFE5AFE5AFE5AFELL // last word of every block under UMEM_CHECK_HARDENED
+#define FREE_POISON 0xDD // fills freed payloads under UMEM_CHECK_HARDENED
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+#define GUARD_BYTES sizeof(long) // the canary is bookkeeping, current_allocated leaves it out
+#else
+#define GUARD_BYTES 0
+#endif
+#define METRICS_SNAPSHOT 0 // metrics_publish calls: counters only
+#define METRICS_ALLOC 1    // plus umalloc's latency and search length
+#define METRICS_FREE 2     // plus ufree's latency
 
 node_t *list_head = NULL;
 node_t *small_free = NULL;
 header_t *header = NULL;
 node_t *last_allocation = NULL;
 static int allocationAlgo;
-int num_allocs = 0;
-int num_deallocs = 0;
-long unsigned int current_free = 0;
-long unsigned int current_allocated = 0;
-float fragmentation = 0.0;
+static int umem_flags; // UMEM_* mode bits passed in with the algorithm
+static char *region_start = NULL;
+static size_t region_size = 0;
 
-int umeminit(size_t sizeOfRegion, int algo)
+// file-backed and shared heaps: the first page of the file or shared
+// memory object. links and the root are kept as offsets from the start of
+// the mapping, so a reopened file can land at any address; 0 stands for NULL
+typedef struct
 {
-    if (list_head != NULL)
+    long magic;
+    long version;
+    long clean; // set by umem_close, cleared while the heap is open
+    long region_size;
+    long head; // first free block
+    long root; // the user's entry point into the heap
+    long num_allocs;
+    long num_deallocs;
+    unsigned long current_allocated;
+    unsigned long current_free;
+
+    // shared heaps only: the lock holder loads the heap state from here
+    // and stores it back, with the list links as offsets in between
+    long cursor; // next fit's last_allocation
+    float fragmentation;
+    pthread_mutex_t lock;
+} file_header_t;
+
+static file_header_t *file_header = NULL; // NULL unless opened by umeminit_file or umeminit_shared
+static bool heap_shared = false;
+static bool heap_buffer = false; // set up by umeminit_buffer on the caller's memory
+static _Thread_local int shared_depth = 0; // recursive holds of the shared lock
+
+// UMEM_THREADED: the heap lock, the thread that owns the heap, and the queue
+// other threads push their frees onto without taking the lock
+static pthread_mutex_t heap_lock;
+static pthread_t heap_owner;
+static _Atomic(void *) remote_frees = NULL;
+
+// UMEM_PERCPU: one cache per CPU, a bounded stack of blocks per size class.
+// with rseq only the CPU a cache belongs to touches it, so pops and pushes
+// need no lock or atomic; without it threads are dealt out over the caches
+// and take the cache's lock. calls served from a cache are counted on it,
+// in its own rseq sequence or under its lock, and folded into num_allocs
+// and num_deallocs under the heap lock
+typedef struct
+{
+    long count[PCPU_CLASSES];
+    void *slots[PCPU_CLASSES][PCPU_DEPTH];
+    pthread_mutex_t lock; // only used without rseq
+    long allocs;          // cache hits so far, only ever grow
+    long deallocs;
+    long folded_allocs; // what pcpu_fold has already added, heap lock
+    long folded_deallocs;
+} __attribute__((aligned(64))) pcpu_cache_t;
+
+static pcpu_cache_t *pcpu_caches = NULL;
+static int pcpu_count = 0;
+static bool pcpu_rseq = false;
+static atomic_uint pcpu_tickets = 0;
+static _Thread_local int pcpu_ticket = -1; // the calling thread's cache without rseq
+static _Thread_local long pcpu_prof_countdown = 0; // the profiler's countdown for cache hits
+static _Thread_local bool pcpu_prof_armed = false;
+static long pcpu_refills = 0;
+
+// UMEM_BACKGROUND: ufree pushes onto the remote queue and counts it, the
+// maintenance thread frees, merges and trims in batches
+static pthread_t background_thread;
+static pthread_mutex_t background_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t background_wake; // on CLOCK_MONOTONIC, set up by background_start
+static bool background_running = false;
+static atomic_int background_pending = 0;
+
+static void shared_lock();
+static void shared_unlock();
+static void pcpu_fold();
+
+static void heap_lock_acquire()
+{
+    // recursive, so urealloc and friends can call back into umalloc/ufree
+    if (umem_flags & UMEM_THREADED)
     {
-        return 0;
+        pthread_mutex_lock(&heap_lock);
     }
+    if (heap_shared)
+    {
+        shared_lock();
+    }
+}
 
-    allocationAlgo = algo;
-    int fd = open("/dev/zero", O_RDWR);
-
-    void *allocated_memory = mmap(NULL, sizeOfRegion, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    if (allocated_memory == MAP_FAILED)
+static void heap_lock_release()
+{
+    if (heap_shared)
     {
-        perror("mmap");
-        exit(1);
+        shared_unlock();
     }
+    if (umem_flags & UMEM_THREADED)
+    {
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
 
-    // set list head and size
-    list_head = (node_t *)allocated_memory;
-    list_head->size = sizeOfRegion;
-    list_head->next = NULL; // set next to null
-    // setting this for stat purposes
-    current_free = sizeOfRegion;
+int num_allocs = 0;
+int num_deallocs = 0;
+long unsigned int current_free = 0;
+long unsigned int current_allocated = 0;
+float fragmentation = 0.0;
+long search_steps = 0; // free blocks inspected by the fit searches
 
-    close(fd);
-    return 0;
-}
+// heap profiler state: one entry per distinct allocation stack
+typedef struct
+{
+    unsigned long hash;
+    int depth;
+    void *stack[PROF_MAX_DEPTH];
+    long live_objs, live_bytes;   // sampled blocks not yet freed
+    long total_objs, total_bytes; // every sample ever taken here
+} prof_site_t;
 
-void *allocate_block(node_t *block, size_t size)
+// one entry per sampled block, so ufree can find its site again
+typedef struct
 {
+    void *ptr;
+    prof_site_t *site;
+    size_t size;
+} prof_live_t;
 
-    size_t rounded_size = size + sizeof(header_t);
-    size_t remaining_size = block->size - rounded_size;
+void coalesce_block(node_t *free_block);
+void free_block(void *ptr);
+node_t *init_free_block(header_t *header, size_t size);
+node_t *find_prev(node_t *block);
+void update_free_stats(size_t size_to_free);
+void shrink_block(header_t *current_header, size_t aligned_new_size, size_t old_size);
+float calculate_fragmentation();
+void reset_values();
 
-    // save the next pointer before modifying the block
-    node_t *saved_next = block->next;
+static prof_site_t prof_sites[PROF_SITE_SLOTS];
+static prof_live_t prof_live[PROF_LIVE_SLOTS];
+static int prof_live_count = 0;
+static size_t prof_rate = 0;
+static long prof_countdown = __LONG_MAX__; // bytes left until the next sample
+static unsigned long prof_rng = 0x9E3779B97F4A7C15UL;
 
-    // now set the magic number
-    ((header_t *)block)->magic = MAGIC;
+static double prof_fast_log2(double x)
+{
+    // exponent from the bits, quadratic fit for the mantissa in [1, 2)
+    union
+    {
+        double d;
+        unsigned long long u;
+    } v = {x};
+    int exponent = (int)((v.u >> 52) & 0x7ff) - 1023;
+    v.u = (v.u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    return exponent + (-0.34484843 * v.d + 2.02466578) * v.d - 1.67487759;
+}
 
-    // handles block splitting
-    if (remaining_size >= sizeof(node_t)) // should i be adding 8 bytes to this as well?
+static long prof_next_interval()
+{
+    if (prof_rate == 0)
     {
-        // create a new block at the end of the allocated block
-        node_t *new_node = (node_t *)((char *)block + rounded_size);
-        new_node->size = remaining_size;
+        return __LONG_MAX__;
+    }
 
-        // if the block we're splitting is the head of the free list
-        if (block == list_head)
-        {
-            new_node->next = saved_next; // Use saved_next pointer
-            list_head = new_node;
-        }
-        else
-        {
-            new_node->next = saved_next; // Use saved_next pointer
+    // exponentially distributed gaps with mean prof_rate, so the samples
+    // form a poisson process over allocated bytes (what pprof expects)
+    prof_rng ^= prof_rng << 13;
+    prof_rng ^= prof_rng >> 7;
+    prof_rng ^= prof_rng << 17;
+    double u = (double)((prof_rng >> 11) + 1) / 9007199254740992.0; // (0, 1]
+    double interval = -prof_fast_log2(u) * 0.6931471805599453 * (double)prof_rate;
+    return (long)interval + 1;
+}
 
-            // set previous node to list head
-            node_t *prev = list_head;
-            // keep searching utnil we find block that points to our target
-            while (prev && prev->next != block)
-            {
-                prev = prev->next;
-            }
-            // if we find it, connect it to our new free block
-            if (prev)
-            {
-                prev->next = new_node;
-            }
-        }
+static unsigned long prof_ptr_slot(void *ptr)
+{
+    return ((((unsigned long)ptr >> 3) * 0x9E3779B97F4A7C15UL) >> 52) & (PROF_LIVE_SLOTS - 1);
+}
 
-        // set the size of the allocated block
-        block->size = rounded_size;
+static prof_site_t *prof_find_site(void **stack, int depth)
+{
+    // fnv-1a over the return addresses
+    unsigned long hash = 1469598103934665603UL;
+    for (int i = 0; i < depth; i++)
+    {
+        hash = (hash ^ (unsigned long)stack[i]) * 1099511628211UL;
     }
-    // if block is not big enough to split
-    else
+
+    // open addressing, the site table never shrinks
+    for (unsigned long i = 0; i < PROF_SITE_SLOTS; i++)
     {
-        // remove the whole block from the list
-        if (block == list_head)
+        prof_site_t *site = &prof_sites[(hash + i) & (PROF_SITE_SLOTS - 1)];
+        if (site->depth == 0)
         {
-            list_head = saved_next; // use saved_next pointer
+            site->hash = hash;
+            site->depth = depth;
+            for (int j = 0; j < depth; j++)
+            {
+                site->stack[j] = stack[j];
+            }
+            return site;
         }
-        else
+        if (site->hash == hash && site->depth == depth)
         {
-            node_t *prev = list_head;
-            while (prev && prev->next != block)
+            int same = 1;
+            for (int j = 0; j < depth && same; j++)
             {
-                prev = prev->next;
+                same = site->stack[j] == stack[j];
             }
-            if (prev)
+            if (same)
             {
-                prev->next = saved_next; // use saved_next pointer
+                return site;
             }
         }
     }
-
-    // update stats
-    // it is my understanding that this should NOT include the size of the header
-    current_allocated += size; // update with "actual" bytes returned to user
-    current_free -= rounded_size;
-    num_allocs++;
-
-    return (void *)((char *)block + sizeof(header_t));
+    return NULL; // table full, drop the sample
 }
 
-void *best(size_t size)
+static void prof_record_alloc(void *ptr, size_t size)
 {
-    // 8 byte alignment
-    size_t required_size = ((size + sizeof(header_t) + 7) / 8) * 8;
-    node_t *current = list_head;
-    node_t *best_fit = NULL;
+    prof_countdown = prof_next_interval();
 
-    // traverse free list
-    while (current != NULL)
+    // leave some headroom so probing stays short
+    if (prof_live_count >= PROF_LIVE_SLOTS * 3 / 4)
     {
-        // if the block is bigger than the size request aligned for 8 bytes
-        if (current->size >= required_size)
-        {
-            // if we haven't found a block yet or the current block is smaller than the best fit
-            if (best_fit == NULL ||
-                current->size < best_fit->size ||
-                (current->size == best_fit->size && current < best_fit))
-            {
-                // set the best fit to the current block
-                best_fit = current;
-            }
-        }
-        current = current->next;
+        return;
     }
 
-    // if we found a block return it
-    if (best_fit != NULL)
+    void *stack[PROF_MAX_DEPTH + 1];
+    int depth = backtrace(stack, PROF_MAX_DEPTH + 1) - 1; // drop this frame
+    if (depth <= 0)
     {
+        return;
+    }
 
-        return allocate_block(best_fit, size);
+    prof_site_t *site = prof_find_site(stack + 1, depth);
+    if (site == NULL)
+    {
+        return;
     }
-    return NULL;
-}
+    site->live_objs++;
+    site->live_bytes += size;
+    site->total_objs++;
+    site->total_bytes += size;
 
-void *worst(size_t size)
-{
+    unsigned long slot = prof_ptr_slot(ptr);
+    while (prof_live[slot].ptr != NULL)
+    {
+        slot = (slot + 1) & (PROF_LIVE_SLOTS - 1);
+    }
+    prof_live[slot].ptr = ptr;
+    prof_live[slot].site = site;
+    prof_live[slot].size = size;
+    prof_live_count++;
 
-    // 8 byte alignment
-    size_t required_size = ((size + sizeof(header_t) + 7) / 8) * 8;
-    node_t *current = list_head;
-    node_t *worst_fit = NULL;
+    // the per-CPU caches free without the heap lock, the mark tells them
+    // which blocks have an entry to drop
+    if (pcpu_caches != NULL)
+    {
+        ((header_t *)((char *)ptr - sizeof(header_t)))->magic = PROF_MAGIC;
+    }
+}
 
-    // traverse free list
-    while (current != NULL)
+static void prof_record_free(void *ptr)
+{
+    unsigned long slot = prof_ptr_slot(ptr);
+    while (prof_live[slot].ptr != ptr)
     {
-        // if the block is bigger than the size request aligned for 8 bytes
-        if (current->size >= required_size)
+        if (prof_live[slot].ptr == NULL)
         {
-            // if we haven't found a block yet or the current block is bigger than the worst fit
-            if (worst_fit == NULL || current->size > worst_fit->size)
-            {
-                worst_fit = current;
-            }
+            return; // not a sampled block
         }
-        current = current->next;
+        slot = (slot + 1) & (PROF_LIVE_SLOTS - 1);
     }
-    // if we found a block return it
-    if (worst_fit != NULL)
+
+    prof_live[slot].site->live_objs--;
+    prof_live[slot].site->live_bytes -= prof_live[slot].size;
+    prof_live[slot].ptr = NULL;
+    prof_live_count--;
+    if (pcpu_caches != NULL)
     {
-        return allocate_block(worst_fit, size);
+        ((header_t *)((char *)ptr - sizeof(header_t)))->magic = MAGIC;
     }
-    return NULL;
-}
-
-void *first(size_t size)
-{
-    // 8 byte alignment
-    size_t required_size = ((size + sizeof(header_t) + 7) / 8) * 8;
-    node_t *current = list_head;
-    node_t *first = NULL;
 
-    // traverse free list
-    while (current != NULL)
+    // backward shift deletion keeps probe chains intact without tombstones
+    unsigned long hole = slot;
+    unsigned long next = (slot + 1) & (PROF_LIVE_SLOTS - 1);
+    while (prof_live[next].ptr != NULL)
     {
-        // if the block is bigger than the size request aligned for 8 bytes
-        if (current->size >= required_size)
+        unsigned long home = prof_ptr_slot(prof_live[next].ptr);
+        // move the entry back if its home slot is not between hole and next
+        if (((next - home) & (PROF_LIVE_SLOTS - 1)) >= ((next - hole) & (PROF_LIVE_SLOTS - 1)))
         {
-            // set the first block that fits the size
-            first = current;
-            break;
+            prof_live[hole] = prof_live[next];
+            prof_live[next].ptr = NULL;
+            hole = next;
         }
-        current = current->next;
+        next = (next + 1) & (PROF_LIVE_SLOTS - 1);
     }
+}
 
-    // if we found a block return it
-    if (first != NULL)
+static void prof_note_alloc(void *ptr, size_t size)
+{
+    // only the countdown is paid when nothing is sampled
+    if (ptr != NULL && (prof_countdown -= (long)size) < 0)
     {
-        return allocate_block(first, size);
+        prof_record_alloc(ptr, size);
     }
-    return NULL;
 }
 
-void *next(size_t size)
+static void prof_clear_live()
 {
+    for (int i = 0; i < PROF_LIVE_SLOTS; i++)
+    {
+        prof_live[i].ptr = NULL;
+    }
+    for (int i = 0; i < PROF_SITE_SLOTS; i++)
+    {
+        prof_sites[i].live_objs = 0;
+        prof_sites[i].live_bytes = 0;
+    }
+    prof_live_count = 0;
+}
 
-    // 8 byte alignment
-    size_t required_size = ((size + sizeof(header_t) + 7) / 8) * 8;
-
-    if (list_head == NULL)
-        return NULL;
+void umem_prof_set_rate(size_t sample_bytes)
+{
+    prof_rate = sample_bytes;
+    prof_countdown = prof_next_interval();
+}
 
-    // if last_allocation is NULL or no longer in the free list, start from head
-    if (last_allocation == NULL)
+void umem_prof_dump(FILE *out)
+{
+    long live_objs = 0, live_bytes = 0, total_objs = 0, total_bytes = 0;
+    for (int i = 0; i < PROF_SITE_SLOTS; i++)
     {
-        last_allocation = list_head;
+        live_objs += prof_sites[i].live_objs;
+        live_bytes += prof_sites[i].live_bytes;
+        total_objs += prof_sites[i].total_objs;
+        total_bytes += prof_sites[i].total_bytes;
     }
-    else
+
+    // legacy pprof heap format: in-use counts first, cumulative in brackets.
+    // heap_v2 tells pprof the values are raw samples it has to scale itself
+    fprintf(out, "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/%zu\n",
+            live_objs, live_bytes, total_objs, total_bytes, prof_rate);
+    for (int i = 0; i < PROF_SITE_SLOTS; i++)
     {
-        // check if last_allocation is still in the free list
-        node_t *check = list_head;
-        bool found = false;
-        while (check != NULL)
+        prof_site_t *site = &prof_sites[i];
+        if (site->depth == 0)
         {
-            // if list head is the last block we allocated
-            if (check == last_allocation)
-            {
-                found = true;
-                break;
-            }
-            check = check->next;
+            continue;
         }
-        // if we don't find the last allocation in the free list, set it to the head
-        if (!found)
+        fprintf(out, "%ld: %ld [%ld: %ld] @", site->live_objs, site->live_bytes,
+                site->total_objs, site->total_bytes);
+        for (int j = 0; j < site->depth; j++)
         {
-            last_allocation = list_head;
+            fprintf(out, " %p", site->stack[j]);
         }
+        fprintf(out, "\n");
     }
 
-    node_t *start = last_allocation;
-    node_t *current = start;
-
-    do
+    // pprof needs the mappings to symbolize the addresses
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps != NULL)
     {
-        // checking to see what the last allocation was
-        // if the current block is big enough for our request
-        if (current->size >= required_size)
-        {
-            // save where to start next search before we modify the block
-            if (current->next != NULL)
-            {
-                last_allocation = current->next;
-            }
-            else
-            {
-                last_allocation = list_head;
-            }
-
-            return allocate_block(current, size);
-        }
-
-        // if there's a next block then move to it, otherwise current is the head
-        if (current->next != NULL)
-        {
-            current = current->next;
-        }
-        else
+        char line[512];
+        fprintf(out, "\nMAPPED_LIBRARIES:\n");
+        while (fgets(line, sizeof(line), maps) != NULL)
         {
-            current = list_head;
+            fputs(line, out);
         }
+        fclose(maps);
+    }
+}
 
-    } while (current != start);
+// live metrics: a page in a named shared memory object that umalloc and
+// ufree rewrite under a sequence count on their way out, so an agent in
+// another process can read it without stopping this one. paths that never
+// take the heap lock, the per-CPU caches and queued frees, don't publish;
+// cache hits reach the counts with the next write but not the histograms.
+// umalloc_hint, urealloc and umemalign refresh the counts only, the
+// histograms stay umalloc and ufree
+static umem_metrics_t *metrics = NULL;
 
-    // if we get here, we've gone through the whole list without finding space
-    last_allocation = NULL; // Reset for next time
-    return NULL;
+static long metrics_clock()
+{
+    if (metrics == NULL)
+    {
+        return 0;
+    }
+    struct timespec now; // vDSO, no syscall
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
 }
 
-void *umalloc(size_t size)
+static int metrics_bucket(unsigned long value)
 {
-    void *allocated_memory = NULL;
-<<<<<<< HEAD
-    // 8 byte alignment
-    size_t aligned_size = ((size + 7) / 8) * 8;
-
-    if (aligned_size == 0) // handle 0 size
-=======
+    int bucket = 63 - __builtin_clzll(value | 1);
+    return bucket < UMEM_METRICS_BUCKETS ? bucket : UMEM_METRICS_BUCKETS - 1;
+}
 
-    if (size == 0) // handle 0 size
->>>>>>> afbf9b4... umalloc final
+static void metrics_publish(int call, long started, long steps)
+{
+    // called under the heap lock, so there is only ever one writer
+    if (metrics == NULL)
     {
-        return NULL;
+        return;
+    }
+    pcpu_fold();
+    long elapsed = call != METRICS_SNAPSHOT ? metrics_clock() - started : 0;
+    unsigned long seq = metrics->seq;
+    __atomic_store_n(&metrics->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    metrics->num_allocs = num_allocs;
+    metrics->num_deallocs = num_deallocs;
+    metrics->current_allocated = current_allocated;
+    metrics->current_free = current_free;
+    metrics->fragmentation = fragmentation;
+    metrics->search_steps = search_steps;
+    if (call == METRICS_ALLOC)
+    {
+        metrics->search_lengths[metrics_bucket(steps)]++;
+        metrics->alloc_latency[metrics_bucket(elapsed > 0 ? elapsed : 0)]++;
+    }
+    else if (call == METRICS_FREE)
+    {
+        metrics->free_latency[metrics_bucket(elapsed > 0 ? elapsed : 0)]++;
     }
+    __atomic_store_n(&metrics->seq, seq + 2, __ATOMIC_RELEASE);
+}
 
-    // determine which algorithm we use
-    switch (allocationAlgo)
+int umem_metrics_export(const char *name)
+{
+    // NULL stops publishing; the object stays until shm_unlink
+    if (metrics != NULL)
+    {
+        munmap(metrics, sizeof(umem_metrics_t));
+        metrics = NULL;
+    }
+    if (name == NULL)
+    {
+        return 0;
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        perror(name);
+        return -1;
+    }
+    umem_metrics_t *page = MAP_FAILED;
+    if (ftruncate(fd, sizeof(umem_metrics_t)) == 0)
+    {
+        page = mmap(NULL, sizeof(umem_metrics_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        perror(name);
+        return -1;
+    }
+
+    // a restarted process starts from a clean page, the count stays even
+    heap_lock_acquire();
+    unsigned long seq = page->seq & ~1UL;
+    memset(page, 0, sizeof(umem_metrics_t));
+    page->seq = seq;
+    page->version = UMEM_METRICS_VERSION;
+    page->pid = getpid();
+    __atomic_store_n(&page->magic, UMEM_METRICS_MAGIC, __ATOMIC_RELEASE);
+    metrics = page;
+    metrics_publish(METRICS_SNAPSHOT, 0, 0);
+    heap_lock_release();
+    return 0;
+}
+
+int umem_metrics_read(const umem_metrics_t *page, umem_metrics_t *out)
+{
+    // retry while a write is in flight or one landed during the copy
+    for (int tries = 0; tries < 1000; tries++)
+    {
+        unsigned long seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            continue;
+        }
+        memcpy(out, (const void *)page, sizeof(umem_metrics_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+        {
+            return out->magic == UMEM_METRICS_MAGIC && out->version == UMEM_METRICS_VERSION ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+// free block size index: the free list mirrored as two arrays in address
+// order, so fit searches scan packed sizes instead of chasing node_t->next.
+// inserting or removing an entry shifts the tail of both arrays, O(n) like
+// the searches themselves; merges and splits that keep the block's slot
+// go through index_update and only pay the binary search
+typedef uint32_t index_vec_t __attribute__((vector_size(32)));
+#define INDEX_LANES (int)(sizeof(index_vec_t) / sizeof(uint32_t))
+
+static uint32_t *index_sizes = NULL;
+static node_t **index_blocks = NULL;
+static int index_count = 0;
+static size_t index_capacity = 0;
+
+static void index_init(size_t sizeOfRegion)
+{
+    // free blocks are at least a node_t each, which bounds the entry count
+    // the pages are only touched as the list actually grows
+    index_capacity = sizeOfRegion / sizeof(node_t) + 1;
+    index_sizes = mmap(NULL, index_capacity * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    index_blocks = mmap(NULL, index_capacity * sizeof(node_t *), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (index_sizes == MAP_FAILED || index_blocks == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    index_count = 0;
+}
+
+static void index_release()
+{
+    if (index_blocks == NULL)
+    {
+        return;
+    }
+    munmap(index_sizes, index_capacity * sizeof(uint32_t));
+    munmap(index_blocks, index_capacity * sizeof(node_t *));
+    index_sizes = NULL;
+    index_blocks = NULL;
+    index_count = 0;
+}
+
+static int index_position(node_t *block)
+{
+    // first entry at or above the block's address
+    int low = 0, high = index_count;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (index_blocks[mid] < block)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void index_insert(node_t *block)
+{
+    if (index_blocks == NULL)
+    {
+        return;
+    }
+    int i = index_position(block);
+    memmove(&index_sizes[i + 1], &index_sizes[i], (index_count - i) * sizeof(uint32_t));
+    memmove(&index_blocks[i + 1], &index_blocks[i], (index_count - i) * sizeof(node_t *));
+    index_sizes[i] = block->size;
+    index_blocks[i] = block;
+    index_count++;
+}
+
+static void index_remove(node_t *block)
+{
+    if (index_blocks == NULL)
+    {
+        return;
+    }
+    int i = index_position(block);
+    memmove(&index_sizes[i], &index_sizes[i + 1], (index_count - i - 1) * sizeof(uint32_t));
+    memmove(&index_blocks[i], &index_blocks[i + 1], (index_count - i - 1) * sizeof(node_t *));
+    index_count--;
+}
+
+static void index_update(node_t *old_block, node_t *block)
+{
+    // block replaces old_block in place, or old_block just changed size
+    if (index_blocks == NULL)
+    {
+        return;
+    }
+    int i = index_position(old_block);
+    index_sizes[i] = block->size;
+    index_blocks[i] = block;
+}
+
+static void index_rebuild()
+{
+    // after the free list was rebuilt wholesale
+    if (index_blocks == NULL)
+    {
+        return;
+    }
+    index_count = 0;
+    for (node_t *current = list_head; current != NULL; current = current->next)
+    {
+        index_sizes[index_count] = current->size;
+        index_blocks[index_count] = current;
+        index_count++;
+    }
+}
+
+static int index_find_equal(uint32_t size)
+{
+    // lowest address holding exactly this size, the caller knows it exists
+    index_vec_t want = {0};
+    want += size;
+    int i = 0;
+    for (; i + INDEX_LANES <= index_count; i += INDEX_LANES)
+    {
+        index_vec_t sizes;
+        memcpy(&sizes, &index_sizes[i], sizeof(sizes));
+        index_vec_t hit = sizes == want;
+        uint64_t any[INDEX_LANES / 2];
+        memcpy(any, &hit, sizeof(any));
+        if ((any[0] | any[1] | any[2] | any[3]) != 0)
+        {
+            break;
+        }
+    }
+    while (index_sizes[i] != size)
+    {
+        i++;
+    }
+    return i;
+}
+
+static node_t *index_first(uint32_t required_size)
+{
+    index_vec_t want = {0};
+    want += required_size;
+    int i = 0;
+    for (; i + INDEX_LANES <= index_count; i += INDEX_LANES)
+    {
+        index_vec_t sizes;
+        memcpy(&sizes, &index_sizes[i], sizeof(sizes));
+        index_vec_t hit = sizes >= want;
+        uint64_t any[INDEX_LANES / 2];
+        memcpy(any, &hit, sizeof(any));
+        if ((any[0] | any[1] | any[2] | any[3]) != 0)
+        {
+            break;
+        }
+    }
+    for (; i < index_count; i++)
+    {
+        if (index_sizes[i] >= required_size)
+        {
+            search_steps += i + 1;
+            return index_blocks[i];
+        }
+    }
+    search_steps += index_count;
+    return NULL;
+}
+
+static node_t *index_best(uint32_t required_size)
+{
+    // lane-wise minimum over the sizes that fit, non-fitting lanes read as max
+    search_steps += index_count;
+    index_vec_t want = {0};
+    want += required_size;
+    index_vec_t smallest = ~(index_vec_t){0};
+    int i = 0;
+    for (; i + INDEX_LANES <= index_count; i += INDEX_LANES)
+    {
+        index_vec_t sizes;
+        memcpy(&sizes, &index_sizes[i], sizeof(sizes));
+        index_vec_t candidate = sizes | ~(index_vec_t)(sizes >= want);
+        index_vec_t smaller = candidate < smallest;
+        smallest = (candidate & smaller) | (smallest & ~smaller);
+    }
+    uint32_t best_size = UINT32_MAX;
+    for (int lane = 0; lane < INDEX_LANES; lane++)
+    {
+        if (smallest[lane] < best_size)
+        {
+            best_size = smallest[lane];
+        }
+    }
+    for (; i < index_count; i++)
+    {
+        if (index_sizes[i] >= required_size && index_sizes[i] < best_size)
+        {
+            best_size = index_sizes[i];
+        }
+    }
+
+    if (best_size == UINT32_MAX)
     {
-    case BEST_FIT:
-<<<<<<< HEAD
-        allocated_memory = best(aligned_size);
-        break;
-    case WORST_FIT:
-        allocated_memory = worst(aligned_size);
-        break;
-    case FIRST_FIT:
-        allocated_memory = first(aligned_size);
-        break;
-    case NEXT_FIT:
-        allocated_memory = next(aligned_size);
-=======
-        allocated_memory = best(size);
-        break;
-    case WORST_FIT:
-        allocated_memory = worst(size);
-        break;
-    case FIRST_FIT:
-        allocated_memory = first(size);
-        break;
-    case NEXT_FIT:
-        allocated_memory = next(size);
->>>>>>> afbf9b4... umalloc final
-        break;
-    default:
         return NULL;
     }
+    return index_blocks[index_find_equal(best_size)];
+}
 
-    // set header if allocation was successful
-    if (allocated_memory != NULL)
+static node_t *index_worst(uint32_t required_size)
+{
+    search_steps += index_count;
+    index_vec_t largest = {0};
+    int i = 0;
+    for (; i + INDEX_LANES <= index_count; i += INDEX_LANES)
     {
-        header_t *allocated_header = (header_t *)((char *)allocated_memory - sizeof(header_t));
+        index_vec_t sizes;
+        memcpy(&sizes, &index_sizes[i], sizeof(sizes));
+        index_vec_t larger = sizes > largest;
+        largest = (sizes & larger) | (largest & ~larger);
     }
-    return allocated_memory;
+    uint32_t worst_size = 0;
+    for (int lane = 0; lane < INDEX_LANES; lane++)
+    {
+        if (largest[lane] > worst_size)
+        {
+            worst_size = largest[lane];
+        }
+    }
+    for (; i < index_count; i++)
+    {
+        if (index_sizes[i] > worst_size)
+        {
+            worst_size = index_sizes[i];
+        }
+    }
+
+    if (index_count == 0 || worst_size < required_size)
+    {
+        return NULL;
+    }
+    return index_blocks[index_find_equal(worst_size)];
 }
 
-float calculate_fragmentation()
+// TLSF: free blocks segregated by size, a bitmap per level says which lists
+// are non-empty. lists are doubly linked through the word after node_t's
+// next, and a free block repeats its size in its last word. the free map
+// marks the first and last 8 bytes of every free block, so a block finds
+// out in O(1) whether its neighbours are free, with no header bits
+static node_t *tlsf_heads[TLSF_FL_COUNT][TLSF_SL_COUNT];
+static uint64_t tlsf_fl_bitmap = 0;
+static uint32_t tlsf_sl_bitmap[TLSF_FL_COUNT];
+static uint64_t *tlsf_free_map = NULL;
+static size_t tlsf_map_words = 0;
+
+static node_t **tlsf_prev(node_t *block)
 {
-    node_t *current = list_head;
-    size_t largest_free = 0;
-    size_t mem_in_small_blocks = 0;
+    return (node_t **)(block + 1);
+}
 
-    //  find the largest free block
-    while (current != NULL)
+static void tlsf_mark(void *granule, bool set)
+{
+    size_t bit = ((char *)granule - region_start) / 8;
+    if (set)
     {
-        if (largest_free < current->size)
+        tlsf_free_map[bit / 64] |= 1ULL << (bit % 64);
+    }
+    else
+    {
+        tlsf_free_map[bit / 64] &= ~(1ULL << (bit % 64));
+    }
+}
+
+static bool tlsf_is_free(void *granule)
+{
+    size_t bit = ((char *)granule - region_start) / 8;
+    return (tlsf_free_map[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void tlsf_mapping(size_t size, int *fl, int *sl)
+{
+    if (size < TLSF_SMALL)
+    {
+        *fl = 0;
+        *sl = size / (TLSF_SMALL / TLSF_SL_COUNT);
+    }
+    else
+    {
+        int msb = 63 - __builtin_clzll(size);
+        *fl = msb - TLSF_FL_SHIFT + 1;
+        *sl = (size >> (msb - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+    }
+}
+
+static void tlsf_insert(node_t *block)
+{
+    int fl, sl;
+    tlsf_mapping(block->size, &fl, &sl);
+    block->next = tlsf_heads[fl][sl];
+    *tlsf_prev(block) = NULL;
+    if (block->next != NULL)
+    {
+        *tlsf_prev(block->next) = block;
+    }
+    tlsf_heads[fl][sl] = block;
+    tlsf_fl_bitmap |= 1ULL << fl;
+    tlsf_sl_bitmap[fl] |= 1U << sl;
+
+    *(long *)((char *)block + block->size - sizeof(long)) = block->size;
+    tlsf_mark(block, true);
+    tlsf_mark((char *)block + block->size - 8, true);
+}
+
+static void tlsf_remove(node_t *block)
+{
+    int fl, sl;
+    tlsf_mapping(block->size, &fl, &sl);
+    node_t *prev = *tlsf_prev(block);
+    if (prev != NULL)
+    {
+        prev->next = block->next;
+    }
+    else
+    {
+        tlsf_heads[fl][sl] = block->next;
+    }
+    if (block->next != NULL)
+    {
+        *tlsf_prev(block->next) = prev;
+    }
+    if (tlsf_heads[fl][sl] == NULL)
+    {
+        tlsf_sl_bitmap[fl] &= ~(1U << sl);
+        if (tlsf_sl_bitmap[fl] == 0)
         {
-            largest_free = current->size;
+            tlsf_fl_bitmap &= ~(1ULL << fl);
+        }
+    }
+
+    tlsf_mark(block, false);
+    tlsf_mark((char *)block + block->size - 8, false);
+}
+
+static void tlsf_reset()
+{
+    for (int fl = 0; fl < TLSF_FL_COUNT; fl++)
+    {
+        for (int sl = 0; sl < TLSF_SL_COUNT; sl++)
+        {
+            tlsf_heads[fl][sl] = NULL;
+        }
+        tlsf_sl_bitmap[fl] = 0;
+    }
+    tlsf_fl_bitmap = 0;
+    memset(tlsf_free_map, 0, tlsf_map_words * sizeof(uint64_t));
+}
+
+static void tlsf_init()
+{
+    tlsf_map_words = region_size / 8 / 64 + 1;
+    tlsf_free_map = mmap(NULL, tlsf_map_words * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tlsf_free_map == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    tlsf_reset();
+}
+
+static void tlsf_release_map()
+{
+    if (tlsf_free_map == NULL)
+    {
+        return;
+    }
+    munmap(tlsf_free_map, tlsf_map_words * sizeof(uint64_t));
+    tlsf_free_map = NULL;
+    tlsf_map_words = 0;
+}
+
+static void tlsf_release(node_t *block)
+{
+    // merge with the block behind, then the one in front through its footer
+    char *next = (char *)block + block->size;
+    if (next < region_start + region_size && tlsf_is_free(next))
+    {
+        tlsf_remove((node_t *)next);
+        block->size += ((node_t *)next)->size;
+    }
+    if ((char *)block > region_start && tlsf_is_free((char *)block - 8))
+    {
+        node_t *prev = (node_t *)((char *)block - *(long *)((char *)block - sizeof(long)));
+        tlsf_remove(prev);
+        prev->size += block->size;
+        block = prev;
+    }
+    tlsf_insert(block);
+}
+
+static void tlsf_shrink(header_t *header, size_t new_size, size_t old_size)
+{
+    // every block must be able to go on a list once freed, and a tail too
+    // small to list has to be folded into a free neighbour
+    if (new_size < MIN_BLOCK_SIZE)
+    {
+        new_size = MIN_BLOCK_SIZE;
+    }
+    if (new_size >= old_size)
+    {
+        return;
+    }
+    char *block_end = (char *)header + old_size;
+    size_t tail = old_size - new_size;
+    if (tail < MIN_BLOCK_SIZE)
+    {
+        if (block_end >= region_start + region_size || !tlsf_is_free(block_end))
+        {
+            return;
         }
-        current = current->next;
+        // unlink the neighbour before the tail's node_t lands on its size
+        tlsf_remove((node_t *)block_end);
+        tail += ((node_t *)block_end)->size;
+    }
+
+    header->size = new_size;
+    current_allocated -= old_size - new_size;
+    current_free += old_size - new_size;
+    node_t *free_block = (node_t *)((char *)header + new_size);
+    free_block->size = tail;
+    tlsf_release(free_block);
+}
+
+static void tlsf_adopt_list()
+{
+    // take over a free list built the ordinary way
+    tlsf_reset();
+    while (list_head != NULL)
+    {
+        node_t *block = list_head;
+        list_head = block->next;
+        tlsf_insert(block);
+    }
+}
+
+static void *tlsf_alloc(size_t size)
+{
+    if (size == 0)
+    {
+        return NULL;
+    }
+    size_t aligned_size = ((size + 7) / 8) * 8;
+    size_t required_size = aligned_size + sizeof(header_t);
+    if (required_size < MIN_BLOCK_SIZE)
+    {
+        required_size = MIN_BLOCK_SIZE;
+    }
+
+    // round up to the next list boundary so any block found is big enough
+    size_t search_size = required_size;
+    if (search_size >= TLSF_SMALL)
+    {
+        search_size += (1UL << (63 - __builtin_clzll(search_size) - TLSF_SL_LOG2)) - 1;
+    }
+    else
+    {
+        search_size += TLSF_SMALL / TLSF_SL_COUNT - 1;
+    }
+    int fl, sl;
+    tlsf_mapping(search_size, &fl, &sl);
+    node_t *block = NULL;
+    uint32_t sl_map = fl < TLSF_FL_COUNT ? tlsf_sl_bitmap[fl] & (~0U << sl) : 0;
+    if (sl_map == 0 && fl + 1 < TLSF_FL_COUNT)
+    {
+        uint64_t fl_map = tlsf_fl_bitmap & (~0ULL << (fl + 1));
+        if (fl_map != 0)
+        {
+            fl = __builtin_ctzll(fl_map);
+            sl_map = tlsf_sl_bitmap[fl];
+        }
+    }
+    if (sl_map != 0)
+    {
+        block = tlsf_heads[fl][__builtin_ctz(sl_map)];
+    }
+    else
+    {
+        // rounding up skipped the request's own list, its head may still fit
+        tlsf_mapping(required_size, &fl, &sl);
+        if (tlsf_heads[fl][sl] != NULL && (size_t)tlsf_heads[fl][sl]->size >= required_size)
+        {
+            block = tlsf_heads[fl][sl];
+        }
+    }
+    search_steps++;
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    tlsf_remove(block);
+    if (block->size - required_size >= MIN_BLOCK_SIZE)
+    {
+        node_t *rest = (node_t *)((char *)block + required_size);
+        rest->size = block->size - required_size;
+        block->size = required_size;
+        tlsf_insert(rest);
+    }
+
+    header_t *header = (header_t *)block;
+    header->magic = MAGIC;
+    current_allocated += header->size - sizeof(header_t) - GUARD_BYTES;
+    current_free -= header->size;
+    num_allocs++;
+    return (char *)header + sizeof(header_t);
+}
+
+static float tlsf_fragmentation()
+{
+    // calculate_fragmentation over every list instead of the one list
+    size_t largest_free = 0;
+    size_t mem_in_small_blocks = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int fl = 0; fl < TLSF_FL_COUNT; fl++)
+        {
+            for (int sl = 0; sl < TLSF_SL_COUNT; sl++)
+            {
+                for (node_t *block = tlsf_heads[fl][sl]; block != NULL; block = block->next)
+                {
+                    if (pass == 0 && (size_t)block->size > largest_free)
+                    {
+                        largest_free = block->size;
+                    }
+                    if (pass == 1 && (size_t)block->size < largest_free / 2)
+                    {
+                        mem_in_small_blocks += block->size;
+                    }
+                }
+            }
+        }
+    }
+    fragmentation = current_free != 0 ? ((float)mem_in_small_blocks / (float)current_free) * 100.0 : 0.0;
+    return fragmentation;
+}
+
+// UMEM_OUT_OF_BAND: block sizes, states and free list links live in a
+// table at the front of the region with one entry per OOB_GRANULE of
+// payload, so payloads carry no header_t or node_t and a fit search only
+// reads the table. a block's first entry holds its size in granules, the
+// second holds the free list link while it is free, the rest stay 0.
+// free one granule blocks have no second entry, they keep their link in
+// the first and wait on a list of their own until umem_consolidate
+static uint32_t *oob_entries = NULL;
+static char *oob_base = NULL; // granule 0
+static uint32_t oob_granules = 0;
+static uint32_t oob_head = OOB_NIL;    // free list in address order
+static uint32_t oob_singles = OOB_NIL; // free one granule blocks
+static uint32_t oob_cursor = 0;        // next fit resumes at this granule
+
+static int oob_init()
+{
+    // an entry per granule, the table rounded up to a cache line; the
+    // region has to hold the table and at least one free block after it
+    size_t granules = region_size / (OOB_GRANULE + sizeof(uint32_t));
+    size_t table = (granules * sizeof(uint32_t) + 63) & ~(size_t)63;
+    if (region_size < table + 2 * OOB_GRANULE)
+    {
+        return -1;
+    }
+    granules = (region_size - table) / OOB_GRANULE;
+    if (granules > OOB_SIZE_MASK - 1)
+    {
+        granules = OOB_SIZE_MASK - 1;
+    }
+
+    oob_entries = (uint32_t *)region_start;
+    oob_base = region_start + table;
+    oob_granules = granules;
+    memset(oob_entries, 0, table);
+    oob_entries[0] = granules | OOB_START;
+    oob_entries[1] = OOB_NIL;
+    oob_head = 0;
+    oob_singles = OOB_NIL;
+    oob_cursor = 0;
+    list_head = NULL;
+    current_free = granules * OOB_GRANULE;
+    return 0;
+}
+
+static uint32_t oob_size(uint32_t entry)
+{
+    return (entry & OOB_SINGLE) ? 1 : entry & OOB_SIZE_MASK;
+}
+
+static void oob_link(uint32_t prev, uint32_t block)
+{
+    if (prev == OOB_NIL)
+    {
+        oob_head = block;
+    }
+    else
+    {
+        oob_entries[prev + 1] = block;
+    }
+}
+
+static void oob_park(uint32_t block)
+{
+    oob_entries[block] = OOB_START | OOB_SINGLE | oob_singles;
+    oob_singles = block;
+}
+
+static uint32_t oob_granule_of(void *ptr)
+{
+    // only the start of a block in use has both bits set
+    size_t offset = (char *)ptr - oob_base;
+    if ((char *)ptr < oob_base || offset >= (size_t)oob_granules * OOB_GRANULE ||
+        offset % OOB_GRANULE != 0 || !(oob_entries[offset / OOB_GRANULE] & OOB_START))
+    {
+        fprintf(stderr, "Error: Invalid pointer %p\n", ptr);
+        exit(1);
+    }
+    if (!(oob_entries[offset / OOB_GRANULE] & OOB_USED))
+    {
+        fprintf(stderr, "Error: Double free detected at block %p\n", ptr);
+        exit(1);
+    }
+    return offset / OOB_GRANULE;
+}
+
+static void *oob_take(uint32_t block, uint32_t need)
+{
+    oob_entries[block] = need | OOB_START | OOB_USED;
+    oob_cursor = block;
+    current_allocated += need * OOB_GRANULE - GUARD_BYTES;
+    current_free -= need * OOB_GRANULE;
+    num_allocs++;
+    return oob_base + (size_t)block * OOB_GRANULE;
+}
+
+static void *oob_carve(uint32_t prev, uint32_t block, uint32_t lead, uint32_t need)
+{
+    // the free pieces on either side take the block's place in the list
+    uint32_t size = oob_entries[block] & OOB_SIZE_MASK;
+    uint32_t link = oob_entries[block + 1];
+    uint32_t start = block + lead;
+    uint32_t tail = size - lead - need;
+    if (tail == 1)
+    {
+        oob_park(start + need);
+    }
+    else if (tail != 0)
+    {
+        oob_entries[start + need] = tail | OOB_START;
+        oob_entries[start + need + 1] = link;
+        link = start + need;
+    }
+    if (lead > 1)
+    {
+        oob_entries[block] = lead | OOB_START;
+        oob_entries[block + 1] = link;
+    }
+    else
+    {
+        oob_link(prev, link);
+        if (lead == 1)
+        {
+            oob_park(block);
+        }
+    }
+    if (need > 1)
+    {
+        oob_entries[start + 1] = 0;
+    }
+    return oob_take(start, need);
+}
+
+static void oob_consolidate()
+{
+    // merge every run of free blocks and rebuild both lists
+    uint32_t tail = OOB_NIL;
+    oob_head = OOB_NIL;
+    oob_singles = OOB_NIL;
+    uint32_t block = 0;
+    while (block < oob_granules)
+    {
+        uint32_t size = oob_size(oob_entries[block]);
+        if (oob_entries[block] & OOB_USED)
+        {
+            block += size;
+            continue;
+        }
+        uint32_t next = block + size;
+        while (next < oob_granules && !(oob_entries[next] & OOB_USED))
+        {
+            uint32_t next_size = oob_size(oob_entries[next]);
+            oob_entries[next] = 0;
+            if (next_size > 1)
+            {
+                oob_entries[next + 1] = 0;
+            }
+            next += next_size;
+        }
+        size = next - block;
+        if (size == 1)
+        {
+            oob_park(block);
+        }
+        else
+        {
+            oob_entries[block] = size | OOB_START;
+            oob_entries[block + 1] = OOB_NIL;
+            oob_link(tail, block);
+            tail = block;
+        }
+        block = next;
+    }
+}
+
+static uint32_t oob_search(uint32_t need, uint32_t *found_prev)
+{
+    // the list policies over table entries; next fit takes the first fit
+    // at or after the cursor, then wraps around
+    uint32_t found = OOB_NIL, found_size = 0;
+    for (int pass = 0; pass < 2 && found == OOB_NIL; pass++)
+    {
+        uint32_t prev = OOB_NIL;
+        for (uint32_t block = oob_head; block != OOB_NIL; prev = block, block = oob_entries[block + 1])
+        {
+            uint32_t block_size = oob_entries[block] & OOB_SIZE_MASK;
+            search_steps++;
+            if (block_size < need || (allocationAlgo == NEXT_FIT && pass == 0 && block < oob_cursor))
+            {
+                continue;
+            }
+            if (found == OOB_NIL || (allocationAlgo == BEST_FIT && block_size < found_size) ||
+                (allocationAlgo == WORST_FIT && block_size > found_size))
+            {
+                found = block;
+                *found_prev = prev;
+                found_size = block_size;
+            }
+            if (allocationAlgo == FIRST_FIT || allocationAlgo == NEXT_FIT ||
+                (allocationAlgo == BEST_FIT && block_size == need))
+            {
+                break;
+            }
+        }
+        if (allocationAlgo != NEXT_FIT)
+        {
+            break;
+        }
+    }
+    return found;
+}
+
+static void *oob_alloc(size_t size)
+{
+    if (size == 0 || size > (size_t)oob_granules * OOB_GRANULE)
+    {
+        return NULL;
+    }
+    uint32_t need = (size + OOB_GRANULE - 1) / OOB_GRANULE;
+
+    // one granule requests are an exact fit for any parked single
+    if (need == 1 && oob_singles != OOB_NIL)
+    {
+        uint32_t block = oob_singles;
+        oob_singles = oob_entries[block] & OOB_SIZE_MASK;
+        return oob_take(block, 1);
+    }
+
+    uint32_t prev = OOB_NIL;
+    uint32_t found = oob_search(need, &prev);
+    if (found == OOB_NIL && oob_singles != OOB_NIL)
+    {
+        // parked singles may be what keeps two free blocks apart
+        oob_consolidate();
+        found = oob_search(need, &prev);
+    }
+    return found != OOB_NIL ? oob_carve(prev, found, 0, need) : NULL;
+}
+
+static void *oob_aligned(size_t alignment, size_t size)
+{
+    // first block with room for the request at an aligned start, the
+    // granules in front of it stay free
+    if (size == 0 || size > (size_t)oob_granules * OOB_GRANULE)
+    {
+        return NULL;
+    }
+    uint32_t need = (size + OOB_GRANULE - 1) / OOB_GRANULE;
+    uint32_t prev = OOB_NIL;
+    for (uint32_t block = oob_head; block != OOB_NIL; prev = block, block = oob_entries[block + 1])
+    {
+        uintptr_t addr = (uintptr_t)(oob_base + (size_t)block * OOB_GRANULE);
+        uintptr_t aligned = (addr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        size_t lead = (aligned - addr) / OOB_GRANULE;
+        search_steps++;
+        if (lead + need <= (oob_entries[block] & OOB_SIZE_MASK))
+        {
+            return oob_carve(prev, block, lead, need);
+        }
+    }
+    return NULL;
+}
+
+static void oob_insert(uint32_t block)
+{
+    // address ordered insert, merging with the free neighbours on the list
+    uint32_t size = oob_entries[block] & OOB_SIZE_MASK;
+    uint32_t prev = OOB_NIL;
+    uint32_t next = oob_head;
+    while (next != OOB_NIL && next < block)
+    {
+        prev = next;
+        next = oob_entries[next + 1];
+    }
+
+    uint32_t link = next;
+    if (next != OOB_NIL && block + size == next)
+    {
+        size += oob_entries[next] & OOB_SIZE_MASK;
+        link = oob_entries[next + 1];
+        oob_entries[next] = 0;
+        oob_entries[next + 1] = 0;
+    }
+    if (prev != OOB_NIL && prev + (oob_entries[prev] & OOB_SIZE_MASK) == block)
+    {
+        oob_entries[prev] = ((oob_entries[prev] & OOB_SIZE_MASK) + size) | OOB_START;
+        oob_entries[prev + 1] = link;
+        oob_entries[block] = 0;
+        oob_entries[block + 1] = 0;
+        return;
+    }
+    oob_entries[block] = size | OOB_START;
+    oob_entries[block + 1] = link;
+    oob_link(prev, block);
+}
+
+static void oob_release(uint32_t block, uint32_t size)
+{
+    if (size == 1)
+    {
+        oob_park(block);
+        return;
+    }
+    oob_entries[block] = size | OOB_START;
+    oob_insert(block);
+}
+
+static void oob_free(void *ptr)
+{
+    uint32_t block = oob_granule_of(ptr);
+    uint32_t size = oob_entries[block] & OOB_SIZE_MASK;
+    size_t bytes = (size_t)size * OOB_GRANULE;
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    if (*(long *)((char *)ptr + bytes - sizeof(long)) != GUARD_CANARY)
+    {
+        fprintf(stderr, "Error: Buffer overflow detected at block %p\n", ptr);
+        exit(1);
+    }
+    memset(ptr, FREE_POISON, bytes);
+#endif
+    current_allocated -= bytes - GUARD_BYTES;
+    current_free += bytes;
+    num_deallocs++;
+    oob_release(block, size);
+    calculate_fragmentation();
+}
+
+static uint32_t oob_absorb(uint32_t block, uint32_t need)
+{
+    // grow into a listed free block right behind if that reaches need,
+    // taking it off the list; returns the block's size either way
+    uint32_t have = oob_entries[block] & OOB_SIZE_MASK;
+    uint32_t next = block + have;
+    if (next >= oob_granules || (oob_entries[next] & (OOB_USED | OOB_SINGLE)) ||
+        have + (oob_entries[next] & OOB_SIZE_MASK) < need)
+    {
+        return have;
+    }
+    uint32_t prev = OOB_NIL;
+    for (uint32_t free = oob_head; free != next; free = oob_entries[free + 1])
+    {
+        prev = free;
+    }
+    oob_link(prev, oob_entries[next + 1]);
+    uint32_t next_size = oob_entries[next] & OOB_SIZE_MASK;
+    oob_entries[next] = 0;
+    oob_entries[next + 1] = 0;
+    have += next_size;
+    oob_entries[block] = have | OOB_START | OOB_USED;
+    current_allocated += (size_t)next_size * OOB_GRANULE;
+    current_free -= (size_t)next_size * OOB_GRANULE;
+    return have;
+}
+
+static void *oob_resize(void *ptr, size_t size)
+{
+    uint32_t block = oob_granule_of(ptr);
+    if (size > (size_t)oob_granules * OOB_GRANULE)
+    {
+        return NULL;
+    }
+    uint32_t have = oob_entries[block] & OOB_SIZE_MASK;
+    uint32_t need = (size + OOB_GRANULE - 1) / OOB_GRANULE;
+
+    if (need > have)
+    {
+        have = oob_absorb(block, need);
+    }
+    if (need <= have)
+    {
+        // give back the granules past the new end
+        if (need < have)
+        {
+            oob_entries[block] = need | OOB_START | OOB_USED;
+            current_allocated -= (size_t)(have - need) * OOB_GRANULE;
+            current_free += (size_t)(have - need) * OOB_GRANULE;
+            oob_release(block + need, have - need);
+        }
+        return ptr;
+    }
+
+    void *new_ptr = oob_alloc(size);
+    if (new_ptr != NULL)
+    {
+        memcpy(new_ptr, ptr, (size_t)have * OOB_GRANULE);
+        oob_free(ptr);
+    }
+    return new_ptr;
+}
+
+static size_t oob_expand(void *ptr, size_t min_size, size_t preferred_size)
+{
+    // oob_resize's growth without the fallback move: the block either
+    // reaches min_size where it is or stays as it was
+    uint32_t block = oob_granule_of(ptr);
+    uint32_t have = oob_entries[block] & OOB_SIZE_MASK;
+    if (min_size > (size_t)oob_granules * OOB_GRANULE)
+    {
+        return 0;
+    }
+    uint32_t need = (min_size + OOB_GRANULE - 1) / OOB_GRANULE;
+    uint32_t want = preferred_size < (size_t)oob_granules * OOB_GRANULE
+                        ? (preferred_size + OOB_GRANULE - 1) / OOB_GRANULE
+                        : oob_granules;
+    if (want < need)
+    {
+        want = need;
+    }
+    if (have >= want)
+    {
+        return (size_t)have * OOB_GRANULE;
+    }
+    have = oob_absorb(block, need > have ? need : have + 1);
+    if (have < need)
+    {
+        return 0;
+    }
+
+    // hand back what lies past preferred_size
+    if (have > want)
+    {
+        oob_entries[block] = want | OOB_START | OOB_USED;
+        current_allocated -= (size_t)(have - want) * OOB_GRANULE;
+        current_free += (size_t)(have - want) * OOB_GRANULE;
+        oob_release(block + want, have - want);
+        have = want;
+    }
+    return (size_t)have * OOB_GRANULE;
+}
+
+static size_t oob_usable(void *ptr)
+{
+    return (size_t)(oob_entries[oob_granule_of(ptr)] & OOB_SIZE_MASK) * OOB_GRANULE;
+}
+
+static size_t oob_largest()
+{
+    size_t largest = oob_singles != OOB_NIL ? OOB_GRANULE : 0;
+    for (uint32_t block = oob_head; block != OOB_NIL; block = oob_entries[block + 1])
+    {
+        if ((size_t)(oob_entries[block] & OOB_SIZE_MASK) * OOB_GRANULE > largest)
+        {
+            largest = (size_t)(oob_entries[block] & OOB_SIZE_MASK) * OOB_GRANULE;
+        }
+    }
+    return largest;
+}
+
+static float oob_fragmentation()
+{
+    // calculate_fragmentation over the table's lists
+    size_t largest_free = oob_largest();
+    size_t mem_in_small_blocks = 0;
+    for (uint32_t block = oob_head; block != OOB_NIL; block = oob_entries[block + 1])
+    {
+        if ((size_t)(oob_entries[block] & OOB_SIZE_MASK) * OOB_GRANULE < largest_free / 2)
+        {
+            mem_in_small_blocks += (size_t)(oob_entries[block] & OOB_SIZE_MASK) * OOB_GRANULE;
+        }
+    }
+    for (uint32_t block = oob_singles; block != OOB_NIL; block = oob_entries[block] & OOB_SIZE_MASK)
+    {
+        if (OOB_GRANULE < largest_free / 2)
+        {
+            mem_in_small_blocks += OOB_GRANULE;
+        }
+    }
+    fragmentation = current_free != 0 ? ((float)mem_in_small_blocks / (float)current_free) * 100.0 : 0.0;
+    return fragmentation;
+}
+
+static int oob_walk(umem_walk_fn callback, void *arg)
+{
+    // the table first, so the blocks still cover the region from its start
+    callback(region_start, oob_base - region_start, UMEM_BLOCK_META, arg);
+    int blocks = 1;
+    uint32_t block = 0;
+    while (block < oob_granules)
+    {
+        uint32_t entry = oob_entries[block];
+        uint32_t size = oob_size(entry);
+        if (!(entry & OOB_START) || size == 0 || size > oob_granules - block)
+        {
+            fprintf(stderr, "Error: Heap walk stopped at damaged block %p\n", oob_base + (size_t)block * OOB_GRANULE);
+            return -1;
+        }
+        int state = (entry & OOB_USED) ? UMEM_BLOCK_USED : (entry & OOB_SINGLE) ? UMEM_BLOCK_PARKED : UMEM_BLOCK_FREE;
+        callback(oob_base + (size_t)block * OOB_GRANULE, (size_t)size * OOB_GRANULE, state, arg);
+        blocks++;
+        block += size;
+    }
+    return blocks;
+}
+
+// small block runs: RUN_SIZE aligned spans carved out of the region and
+// cut into equal slots. occupancy lives in the span descriptor, out of
+// band, so the slots carry no header_t and no node_t. a flat page map
+// leads from a pointer's page to its descriptor
+typedef struct small_run
+{
+    struct small_run *next, *prev; // partially used runs of the same class, or the cache
+    char *base;
+    uint32_t slot_size; // the size class while the span is a run
+    uint32_t free_slots;
+    int state;          // SPAN_RUN, SPAN_CACHED or SPAN_UNUSED
+    unsigned owner;     // UMEM_THREAD_SPANS: the thread that cuts slots from it, 0 for any
+    uint64_t summary;          // bit i set while words[i] has a free slot
+    uint64_t words[RUN_WORDS]; // bit set = slot free
+} small_run_t;
+
+// quick bins: freed blocks parked by exact size, skipping coalescing, until
+// they are reused or consolidated back into the free list
+static header_t *quick_bins[QUICK_MAX_BLOCK / 8 + 1];
+static size_t quick_bytes = 0;
+
+// movable allocations: the table is the only place their address is kept,
+// so umem_compact can slide them and rewrite the entry
+typedef struct
+{
+    void *ptr; // NULL when the slot is unused
+    int pins;  // outstanding umem_hlock calls
+} handle_t;
+
+static handle_t handles[MAX_HANDLES];
+
+static small_run_t **small_runs = NULL; // page map: one entry per page of the region, NULL unless a span
+static size_t small_windows = 0;
+static small_run_t *span_pool = NULL;   // unused descriptors
+static small_run_t *span_chunks = NULL; // pages the descriptors come from, linked through their first slot
+static small_run_t *span_cache = NULL;  // empty runs, linked through next
+static int span_cached = 0;
+static small_run_t *small_partial[SMALL_CLASSES];
+static unsigned small_epoch = 0; // bumped by small_init, so threads drop runs of an earlier heap
+
+// UMEM_SIZE_CLASSES: requests seen per 8 byte bucket, and the slot class
+// each bucket is served from. both are indexed by size / SMALL_GRANULE - 1
+static uint8_t small_class_map[SMALL_CLASSES];
+static long small_hist_count[SMALL_CLASSES];
+static long small_hist_bytes[SMALL_CLASSES];
+static long small_hist_total = 0; // decays with the counts
+static long small_seen = 0;       // small requests since umeminit
+
+static int small_default_class(int bucket)
+{
+    int step = SMALL_STEP / SMALL_GRANULE;
+    return (bucket / step + 1) * step - 1;
+}
+
+static void small_default_classes()
+{
+    for (int b = 0; b < SMALL_CLASSES; b++)
+    {
+        small_class_map[b] = small_default_class(b);
+    }
+}
+
+static void small_init()
+{
+    small_windows = (((unsigned long)region_start + region_size) >> RUN_SHIFT) -
+                    ((unsigned long)region_start >> RUN_SHIFT) + 1;
+    small_runs = mmap(NULL, small_windows * sizeof(small_run_t *), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (small_runs == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    for (int i = 0; i < SMALL_CLASSES; i++)
+    {
+        small_partial[i] = NULL;
+        small_hist_count[i] = 0;
+        small_hist_bytes[i] = 0;
+    }
+    small_hist_total = 0;
+    small_seen = 0;
+    small_epoch++;
+    small_default_classes();
+}
+
+static void small_release()
+{
+    if (small_runs == NULL)
+    {
+        return;
+    }
+    munmap(small_runs, small_windows * sizeof(small_run_t *));
+    small_runs = NULL;
+    small_windows = 0;
+    while (span_chunks != NULL)
+    {
+        small_run_t *chunk = span_chunks;
+        span_chunks = chunk->next;
+        munmap(chunk, RUN_SIZE);
+    }
+    span_pool = NULL;
+    span_cache = NULL;
+    span_cached = 0;
+    for (int i = 0; i < SMALL_CLASSES; i++)
+    {
+        small_partial[i] = NULL;
+    }
+}
+
+static small_run_t **span_entry(void *ptr)
+{
+    return &small_runs[((unsigned long)ptr >> RUN_SHIFT) - ((unsigned long)region_start >> RUN_SHIFT)];
+}
+
+static small_run_t *span_of(void *ptr)
+{
+    // a shift and an index: the page a pointer falls in names its span
+    if (small_runs == NULL || (char *)ptr < region_start || (char *)ptr >= region_start + region_size)
+    {
+        return NULL;
+    }
+    return *span_entry(ptr);
+}
+
+static small_run_t *small_run_of(void *ptr)
+{
+    small_run_t *run = span_of(ptr);
+    return run != NULL && run->state == SPAN_RUN ? run : NULL;
+}
+
+static small_run_t *span_new(char *base)
+{
+    // descriptors come a page at a time, only spans in use need one
+    if (span_pool == NULL)
+    {
+        small_run_t *chunk = mmap(NULL, RUN_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+        {
+            return NULL;
+        }
+        chunk->next = span_chunks;
+        span_chunks = chunk;
+        for (size_t i = 1; i < RUN_SIZE / sizeof(small_run_t); i++)
+        {
+            chunk[i].next = span_pool;
+            span_pool = &chunk[i];
+        }
+    }
+    small_run_t *run = span_pool;
+    span_pool = run->next;
+    run->base = base;
+    *span_entry(base) = run;
+    return run;
+}
+
+static void small_link(small_run_t *run, int class)
+{
+    run->prev = NULL;
+    run->next = small_partial[class];
+    if (run->next != NULL)
+    {
+        run->next->prev = run;
+    }
+    small_partial[class] = run;
+}
+
+static void small_unlink(small_run_t *run, int class)
+{
+    if (run->prev != NULL)
+    {
+        run->prev->next = run->next;
+    }
+    else
+    {
+        small_partial[class] = run->next;
+    }
+    if (run->next != NULL)
+    {
+        run->next->prev = run->prev;
+    }
+}
+
+// UMEM_THREAD_SPANS: a thread only takes slots from runs it owns, and
+// runs are RUN_SIZE aligned, so no cache line holds blocks of two threads.
+// the runs of a thread that exits go back to owner 0 and the next thread
+// short of a run of that class adopts one
+static _Thread_local unsigned span_thread = 0;
+static _Thread_local small_run_t *span_current[SMALL_CLASSES]; // the run each class last took slots from
+static _Thread_local unsigned span_current_epoch = 0;
+static unsigned span_threads = 0;
+static pthread_key_t span_exit_key;
+static pthread_once_t span_key_once = PTHREAD_ONCE_INIT;
+
+static void span_thread_exit(void *arg)
+{
+    (void)arg;
+    if (!(umem_flags & UMEM_THREAD_SPANS))
+    {
+        return; // the heap the thread used is gone
+    }
+    heap_lock_acquire();
+    for (size_t w = 0; small_runs != NULL && w < small_windows; w++)
+    {
+        if (small_runs[w] != NULL && small_runs[w]->owner == span_thread)
+        {
+            small_runs[w]->owner = 0;
+        }
+    }
+    heap_lock_release();
+}
+
+static void span_key_create()
+{
+    pthread_key_create(&span_exit_key, span_thread_exit);
+}
+
+static small_run_t *span_own_run(int class)
+{
+    if (span_thread == 0)
+    {
+        span_thread = ++span_threads;
+        pthread_once(&span_key_once, span_key_create);
+        pthread_setspecific(span_exit_key, &span_thread); // any non-NULL value runs the destructor
+    }
+    if (span_current_epoch != small_epoch)
+    {
+        memset(span_current, 0, sizeof(span_current));
+        span_current_epoch = small_epoch;
+    }
+
+    // the run used last, as long as it is still this thread's, of this
+    // class and has room; a descriptor that was retired and recut fails
+    // one of those unless it is just as good
+    small_run_t *current = span_current[class];
+    if (current != NULL && current->state == SPAN_RUN && current->owner == span_thread &&
+        current->slot_size == (uint32_t)(class + 1) * SMALL_GRANULE && current->free_slots > 0)
+    {
+        return current;
+    }
+
+    // only when that run fills up: another own run with room, else an orphan
+    small_run_t *orphan = NULL;
+    for (small_run_t *run = small_partial[class]; run != NULL; run = run->next)
+    {
+        if (run->owner == span_thread)
+        {
+            span_current[class] = run;
+            return run;
+        }
+        if (run->owner == 0 && orphan == NULL)
+        {
+            orphan = run;
+        }
+    }
+    if (orphan != NULL)
+    {
+        orphan->owner = span_thread;
+    }
+    span_current[class] = orphan;
+    return orphan;
+}
+
+static bool window_fits(node_t *block, size_t min_gap, char **base)
+{
+    // a RUN_SIZE aligned window with its header, and a gap in front that
+    // is either nothing or big enough to stay a free block
+    char *window = (char *)(((uintptr_t)block + sizeof(header_t) + RUN_SIZE - 1) & ~(uintptr_t)(RUN_SIZE - 1));
+    size_t lead = window - sizeof(header_t) - (char *)block;
+    if (lead != 0 && lead < min_gap)
+    {
+        window += RUN_SIZE;
+    }
+    *base = window;
+    return window + RUN_SIZE <= (char *)block + block->size;
+}
+
+static char *window_take()
+{
+    // cut a run window straight out of a free block that holds one, the
+    // space around it goes back to the free structures; nothing is
+    // over-allocated, and the window counts as neither free nor allocated
+    size_t min_gap = allocationAlgo == TLSF ? MIN_BLOCK_SIZE : sizeof(node_t);
+    node_t *block = NULL;
+    char *base = NULL;
+    if (allocationAlgo == TLSF)
+    {
+        for (int fl = 0; fl < TLSF_FL_COUNT && block == NULL; fl++)
+        {
+            for (int sl = 0; sl < TLSF_SL_COUNT && block == NULL; sl++)
+            {
+                for (node_t *current = tlsf_heads[fl][sl]; current != NULL && block == NULL; current = current->next)
+                {
+                    block = window_fits(current, min_gap, &base) ? current : NULL;
+                }
+            }
+        }
+    }
+    else
+    {
+        for (node_t *current = list_head; current != NULL && block == NULL; current = current->next)
+        {
+            block = window_fits(current, min_gap, &base) ? current : NULL;
+        }
+    }
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    // off its list, then hand back the pieces in front and behind
+    if (allocationAlgo == TLSF)
+    {
+        tlsf_remove(block);
+    }
+    else
+    {
+        node_t *prev = find_prev(block);
+        if (prev == NULL)
+        {
+            list_head = block->next;
+        }
+        else
+        {
+            prev->next = block->next;
+        }
+        index_remove(block);
+        if (last_allocation == block)
+        {
+            last_allocation = block->next != NULL ? block->next : list_head;
+        }
+    }
+    char *block_end = (char *)block + block->size;
+    header_t *header = (header_t *)(base - sizeof(header_t));
+    size_t lead = (char *)header - (char *)block;
+    size_t tail = block_end - (base + RUN_SIZE);
+    header->size = sizeof(header_t) + RUN_SIZE;
+    if (tail < min_gap)
+    {
+        header->size += tail; // too small to list, stays with the window
+        tail = 0;
+    }
+    header->magic = MAGIC;
+    current_free -= header->size;
+    if (lead != 0)
+    {
+        coalesce_block(init_free_block((header_t *)block, lead));
+    }
+    if (tail != 0)
+    {
+        coalesce_block(init_free_block((header_t *)(base + RUN_SIZE), tail));
+    }
+    return base;
+}
+
+static void window_release(char *base)
+{
+    header_t *header = (header_t *)(base - sizeof(header_t));
+    current_free += header->size;
+    coalesce_block(init_free_block(header, header->size));
+}
+
+static small_run_t *small_carve(int class)
+{
+    // reuse an empty span of any class before asking the region for a
+    // new window
+    small_run_t *run = span_cache;
+    if (run != NULL)
+    {
+        span_cache = run->next;
+        span_cached--;
+    }
+    else
+    {
+        char *base = window_take();
+        if (base == NULL)
+        {
+            return NULL;
+        }
+        run = span_new(base);
+        if (run == NULL)
+        {
+            window_release(base);
+            return NULL;
+        }
+    }
+
+    uint32_t slot_size = (class + 1) * SMALL_GRANULE;
+    uint32_t slots = RUN_SIZE / slot_size;
+    run->state = SPAN_RUN;
+    run->owner = (umem_flags & UMEM_THREAD_SPANS) ? span_thread : 0;
+    if (umem_flags & UMEM_THREAD_SPANS)
+    {
+        span_current[class] = run;
+    }
+    run->slot_size = slot_size;
+    run->free_slots = slots;
+    run->summary = 0;
+    for (uint32_t w = 0; w < RUN_WORDS; w++)
+    {
+        uint32_t bits = slots > w * 64 ? slots - w * 64 : 0;
+        run->words[w] = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+        if (run->words[w] != 0)
+        {
+            run->summary |= 1ULL << w;
+        }
+    }
+    small_link(run, class);
+    return run;
+}
+
+static void span_release(small_run_t *run)
+{
+    run->state = SPAN_UNUSED;
+    *span_entry(run->base) = NULL;
+    window_release(run->base);
+    run->next = span_pool;
+    span_pool = run;
+}
+
+static void small_retire(small_run_t *run, int class)
+{
+    // an empty run waits in the span cache for whichever class needs one
+    // next; past SPAN_CACHE_MAX it goes back to the region
+    small_unlink(run, class);
+    if (span_cached < SPAN_CACHE_MAX)
+    {
+        run->state = SPAN_CACHED;
+        run->next = span_cache;
+        span_cache = run;
+        span_cached++;
+        return;
+    }
+    span_release(run);
+}
+
+static bool span_flush()
+{
+    // hand every empty run back to the region: the cached ones and the
+    // last run each class keeps; returns whether anything was freed
+    bool released = false;
+    if (small_runs == NULL)
+    {
+        return false;
+    }
+    for (int c = 0; c < SMALL_CLASSES; c++)
+    {
+        small_run_t *run = small_partial[c];
+        while (run != NULL)
+        {
+            small_run_t *next = run->next;
+            if (run->free_slots == RUN_SIZE / run->slot_size)
+            {
+                small_unlink(run, c);
+                span_release(run);
+                released = true;
+            }
+            run = next;
+        }
+    }
+    while (span_cache != NULL)
+    {
+        small_run_t *run = span_cache;
+        span_cache = run->next;
+        span_release(run);
+        released = true;
+    }
+    span_cached = 0;
+    return released;
+}
+
+static void small_adapt()
+{
+    // start over from the default classes and give the hottest sizes whose
+    // default slot is bigger than they need a class of their own
+    small_default_classes();
+    bool dedicated[SMALL_CLASSES] = {false};
+    for (int n = 0; n < SMALL_DEDICATED; n++)
+    {
+        int hottest = -1;
+        for (int b = 0; b < SMALL_CLASSES; b++)
+        {
+            if (!dedicated[b] && small_class_map[b] != b &&
+                small_hist_count[b] * SMALL_HOT_SHARE >= small_hist_total &&
+                (hottest < 0 || small_hist_count[b] > small_hist_count[hottest]))
+            {
+                hottest = b;
+            }
+        }
+        if (hottest < 0)
+        {
+            break;
+        }
+        small_class_map[hottest] = hottest;
+        dedicated[hottest] = true;
+    }
+
+    // a class nothing maps to any more gives back its cached empty run
+    for (int c = 0; c < SMALL_CLASSES; c++)
+    {
+        small_run_t *run = small_partial[c];
+        bool mapped = false;
+        for (int b = 0; b < SMALL_CLASSES && !mapped; b++)
+        {
+            mapped = small_class_map[b] == c;
+        }
+        if (!mapped && run != NULL && run->next == NULL &&
+            run->free_slots == RUN_SIZE / run->slot_size)
+        {
+            small_retire(run, c);
+        }
+    }
+
+    // halve the history so the classes follow the mix as it shifts
+    for (int b = 0; b < SMALL_CLASSES; b++)
+    {
+        if (small_hist_count[b] != 0)
+        {
+            small_hist_bytes[b] = small_hist_bytes[b] * (small_hist_count[b] / 2) / small_hist_count[b];
+        }
+        small_hist_count[b] /= 2;
+    }
+    small_hist_total /= 2;
+}
+
+static void *small_alloc(size_t size)
+{
+    int bucket = (size + SMALL_GRANULE - 1) / SMALL_GRANULE - 1;
+    if (umem_flags & UMEM_SIZE_CLASSES)
+    {
+        small_hist_count[bucket]++;
+        small_hist_bytes[bucket] += size;
+        small_hist_total++;
+        if (++small_seen % SMALL_REVIEW == 0)
+        {
+            small_adapt();
+        }
+    }
+
+    int class = small_class_map[bucket];
+    small_run_t *run = (umem_flags & UMEM_THREAD_SPANS) ? span_own_run(class) : small_partial[class];
+    if (run == NULL)
+    {
+        run = small_carve(class);
+        if (run == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    // find first set, twice: which word has room, then which slot in it
+    int w = __builtin_ctzll(run->summary);
+    int b = __builtin_ctzll(run->words[w]);
+    run->words[w] &= run->words[w] - 1;
+    if (run->words[w] == 0)
+    {
+        run->summary &= ~(1ULL << w);
+    }
+    if (--run->free_slots == 0)
+    {
+        small_unlink(run, class);
+    }
+
+    num_allocs++;
+    return run->base + (w * 64 + b) * run->slot_size;
+}
+
+static void small_dealloc(small_run_t *run, void *ptr)
+{
+    size_t offset = (char *)ptr - run->base;
+    if (offset % run->slot_size != 0)
+    {
+        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
+        exit(1);
+    }
+    size_t slot = offset / run->slot_size;
+    uint64_t bit = 1ULL << (slot % 64);
+    if (run->words[slot / 64] & bit)
+    {
+        fprintf(stderr, "Error: Double free detected at block %p\n", ptr);
+        exit(1);
+    }
+
+    int class = run->slot_size / SMALL_GRANULE - 1;
+    if (run->free_slots++ == 0)
+    {
+        small_link(run, class);
+    }
+    run->words[slot / 64] |= bit;
+    run->summary |= 1ULL << (slot / 64);
+    num_deallocs++;
+
+    // an empty run is retired unless it is the last one of its class,
+    // which is kept around so alternating alloc/free doesn't thrash
+    if (run->free_slots == RUN_SIZE / run->slot_size &&
+        (run->next != NULL || run->prev != NULL))
+    {
+        small_retire(run, class);
+    }
+}
+
+void umem_class_report(FILE *out)
+{
+    // internal fragmentation over the recent request mix: slot bytes that
+    // hold no requested byte, with the default classes and with the current
+    long requested = 0, default_slots = 0, current_slots = 0;
+    fprintf(out, "size  requests  slot\n");
+    for (int b = 0; b < SMALL_CLASSES; b++)
+    {
+        if (small_hist_count[b] == 0)
+        {
+            continue;
+        }
+        int slot = (small_class_map[b] + 1) * SMALL_GRANULE;
+        fprintf(out, "%4d  %8ld  %4d%s\n", (b + 1) * SMALL_GRANULE, small_hist_count[b], slot,
+                small_class_map[b] != small_default_class(b) ? " (dedicated)" : "");
+        requested += small_hist_bytes[b];
+        default_slots += small_hist_count[b] * (small_default_class(b) + 1) * SMALL_GRANULE;
+        current_slots += small_hist_count[b] * slot;
+    }
+    if (current_slots != 0)
+    {
+        fprintf(out, "Internal fragmentation: %.2f%% with default classes, %.2f%% now\n",
+                100.0 * (default_slots - requested) / default_slots,
+                100.0 * (current_slots - requested) / current_slots);
+    }
+}
+
+static header_t **quick_link(header_t *block)
+{
+    // the link lives in the payload, the header stays readable
+    return (header_t **)((char *)block + sizeof(header_t));
+}
+
+static void *quick_alloc(size_t size)
+{
+    size_t required_size = ((size + sizeof(header_t) + 7) / 8) * 8;
+    if (required_size > QUICK_MAX_BLOCK || quick_bins[required_size / 8] == NULL)
+    {
+        return NULL;
+    }
+
+    header_t *block = quick_bins[required_size / 8];
+    quick_bins[required_size / 8] = *quick_link(block);
+    quick_bytes -= block->size;
+    block->magic = MAGIC;
+
+    // same accounting as allocate_block
+    current_allocated += required_size - sizeof(header_t) - GUARD_BYTES;
+    current_free -= block->size;
+    num_allocs++;
+    return (char *)block + sizeof(header_t);
+}
+
+void umem_consolidate()
+{
+    heap_lock_acquire();
+    // hand every parked block to the normal merge path, the stats already
+    // count them as free
+    for (size_t i = 0; i <= QUICK_MAX_BLOCK / 8; i++)
+    {
+        while (quick_bins[i] != NULL)
+        {
+            header_t *block = quick_bins[i];
+            quick_bins[i] = *quick_link(block);
+            coalesce_block(init_free_block(block, block->size));
+        }
+    }
+    quick_bytes = 0;
+    if (oob_entries != NULL)
+    {
+        oob_consolidate();
+    }
+    span_flush();
+    heap_lock_release();
+}
+
+static bool quick_free(void *ptr, header_t *header)
+{
+    if (header->magic == QUICK_MAGIC)
+    {
+        fprintf(stderr, "Error: Double free detected at block %p\n", ptr);
+        exit(1);
+    }
+    // bins are indexed by size / 8, so only a size quick_alloc can round a
+    // request up to may be parked; anything else takes the normal path
+    if (header->magic != MAGIC || header->size > QUICK_MAX_BLOCK || header->size % 8 != 0)
+    {
+        return false; // let the normal path validate or merge it
+    }
+
+    header->magic = QUICK_MAGIC;
+    *quick_link(header) = quick_bins[header->size / 8];
+    quick_bins[header->size / 8] = header;
+    quick_bytes += header->size;
+    update_free_stats(header->size);
+
+    // don't let parked blocks starve the list of merge candidates
+    if (quick_bytes > region_size / 8)
+    {
+        umem_consolidate();
+    }
+    return true;
+}
+
+static void remote_push(void *ptr)
+{
+    // tag regular blocks so a second free from any thread is still caught
+    if (small_run_of(ptr) == NULL)
+    {
+        header_t *header = (header_t *)((char *)ptr - sizeof(header_t));
+        if (header->magic == REMOTE_MAGIC || header->magic == QUICK_MAGIC)
+        {
+            fprintf(stderr, "Error: Double free detected at block %p\n", ptr);
+            exit(1);
+        }
+        if (header->magic != MAGIC)
+        {
+            fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
+            exit(1);
+        }
+        header->magic = REMOTE_MAGIC;
+    }
+
+    // treiber push, the link lives in the first payload word
+    void *head = atomic_load_explicit(&remote_frees, memory_order_relaxed);
+    do
+    {
+        *(void **)ptr = head;
+    } while (!atomic_compare_exchange_weak_explicit(&remote_frees, &head, ptr,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+static void remote_drain()
+{
+    // take the whole queue in one exchange, then free it as a batch
+    if (atomic_load_explicit(&remote_frees, memory_order_relaxed) == NULL)
+    {
+        return;
+    }
+    void *ptr = atomic_exchange_explicit(&remote_frees, NULL, memory_order_acquire);
+    while (ptr != NULL)
+    {
+        void *next = *(void **)ptr;
+        if (small_run_of(ptr) == NULL)
+        {
+            ((header_t *)((char *)ptr - sizeof(header_t)))->magic = MAGIC;
+        }
+        free_block(ptr);
+        ptr = next;
+    }
+}
+
+void umem_claim_heap()
+{
+    // frees from any other thread go through the remote queue
+    heap_owner = pthread_self();
+}
+
+static void background_trim(node_t *block)
+{
+    // keep the list links and TLSF's back link and footer, drop the pages
+    // in between; the kernel hands back zero pages when they are touched
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)block + sizeof(node_t) + sizeof(node_t *) + page - 1) & ~(uintptr_t)(page - 1);
+    uintptr_t end = ((uintptr_t)block + block->size - sizeof(long)) & ~(uintptr_t)(page - 1);
+    if (end > start)
+    {
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+}
+
+static void background_pass()
+{
+    if (atomic_load_explicit(&remote_frees, memory_order_relaxed) == NULL)
+    {
+        return;
+    }
+
+    heap_lock_acquire();
+    atomic_store_explicit(&background_pending, 0, memory_order_relaxed);
+    remote_drain();
+    calculate_fragmentation();
+
+    // only a pass that freed something can have made a block worth trimming
+    if (allocationAlgo == TLSF)
+    {
+        for (int fl = 0; fl < TLSF_FL_COUNT; fl++)
+        {
+            for (int sl = 0; sl < TLSF_SL_COUNT; sl++)
+            {
+                for (node_t *block = tlsf_heads[fl][sl]; block != NULL; block = block->next)
+                {
+                    if (block->size >= BACKGROUND_TRIM)
+                    {
+                        background_trim(block);
+                    }
+                }
+            }
+        }
+    }
+    else
+    {
+        for (node_t *block = list_head; block != NULL; block = block->next)
+        {
+            if (block->size >= BACKGROUND_TRIM)
+            {
+                background_trim(block);
+            }
+        }
+    }
+    heap_lock_release();
+}
+
+static void *background_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&background_lock);
+    while (background_running)
+    {
+        // monotonic, so setting the wall clock doesn't stall the thread
+        struct timespec wake;
+        clock_gettime(CLOCK_MONOTONIC, &wake);
+        wake.tv_nsec += BACKGROUND_TICK_MS * 1000000L;
+        if (wake.tv_nsec >= 1000000000L)
+        {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&background_wake, &background_lock, &wake);
+
+        pthread_mutex_unlock(&background_lock);
+        background_pass();
+        pthread_mutex_lock(&background_lock);
+    }
+    pthread_mutex_unlock(&background_lock);
+    return NULL;
+}
+
+static void background_free(void *ptr)
+{
+    // the caller's whole share of the free: a check, a push, and a wakeup
+    // once in a while
+    remote_push(ptr);
+    if (atomic_fetch_add_explicit(&background_pending, 1, memory_order_relaxed) + 1 == BACKGROUND_BATCH)
+    {
+        pthread_cond_signal(&background_wake);
+    }
+}
+
+static void background_start()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&background_wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    background_running = true;
+    if (pthread_create(&background_thread, NULL, background_main, NULL) != 0)
+    {
+        // no thread to hand the work to, ufree does it inline again
+        background_running = false;
+        umem_flags &= ~UMEM_BACKGROUND;
+        pthread_cond_destroy(&background_wake);
+    }
+}
+
+static void background_stop()
+{
+    if (!background_running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&background_lock);
+    background_running = false;
+    pthread_cond_signal(&background_wake);
+    pthread_mutex_unlock(&background_lock);
+    pthread_join(background_thread, NULL);
+    pthread_cond_destroy(&background_wake);
+}
+
+static void pcpu_init()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    pcpu_count = cpus > 0 ? cpus : 1;
+    void *caches = mmap(NULL, pcpu_count * sizeof(pcpu_cache_t), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (caches == MAP_FAILED)
+    {
+        return; // no caches, every call goes to the heap
+    }
+    pcpu_caches = caches;
+    for (int i = 0; i < pcpu_count; i++)
+    {
+        pthread_mutex_init(&pcpu_caches[i].lock, NULL);
+    }
+#if PCPU_RSEQ
+    // glibc registers every thread it starts, unless rseq is turned off
+    pcpu_rseq = __rseq_size > 0;
+#endif
+}
+
+static void pcpu_fold()
+{
+    // called under the heap lock. the owners never reset their counters,
+    // so only what grew since the last fold is added
+    for (int i = 0; pcpu_caches != NULL && i < pcpu_count; i++)
+    {
+        pcpu_cache_t *cache = &pcpu_caches[i];
+        if (!pcpu_rseq)
+        {
+            pthread_mutex_lock(&cache->lock);
+        }
+        long allocs = __atomic_load_n(&cache->allocs, __ATOMIC_RELAXED);
+        long deallocs = __atomic_load_n(&cache->deallocs, __ATOMIC_RELAXED);
+        if (!pcpu_rseq)
+        {
+            pthread_mutex_unlock(&cache->lock);
+        }
+        num_allocs += allocs - cache->folded_allocs;
+        num_deallocs += deallocs - cache->folded_deallocs;
+        cache->folded_allocs = allocs;
+        cache->folded_deallocs = deallocs;
+    }
+}
+
+static void pcpu_release()
+{
+    if (pcpu_caches != NULL)
+    {
+        munmap(pcpu_caches, pcpu_count * sizeof(pcpu_cache_t));
+        pcpu_caches = NULL;
+    }
+}
+
+static void setup_modes(size_t sizeOfRegion)
+{
+    if (umem_flags & UMEM_THREAD_SPANS)
+    {
+        // the runs keep threads apart, a per-CPU cache would mix them again
+        umem_flags |= UMEM_SMALL_BITMAP | UMEM_THREADED;
+    }
+    if (umem_flags & (UMEM_SMALL_BITMAP | UMEM_SIZE_CLASSES))
+    {
+        // the caches refill from the list and would starve the runs of
+        // the very sizes they are for
+        umem_flags &= ~UMEM_PERCPU;
+    }
+    // the index stores sizes as 32 bits
+    if ((umem_flags & UMEM_SIZE_INDEX) && sizeOfRegion <= UINT32_MAX)
+    {
+        index_init(sizeOfRegion);
+        index_rebuild();
+    }
+    if (umem_flags & (UMEM_SMALL_BITMAP | UMEM_SIZE_CLASSES))
+    {
+        small_init();
+    }
+    if (umem_flags & UMEM_PERCPU)
+    {
+        // cache misses and flushes still go through the heap lock
+        umem_flags |= UMEM_THREADED;
+        pcpu_init();
+    }
+    if (umem_flags & UMEM_BACKGROUND)
+    {
+        // the maintenance thread shares the heap with its callers
+        umem_flags |= UMEM_THREADED;
+    }
+    if (umem_flags & UMEM_THREADED)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&heap_lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        heap_owner = pthread_self();
+    }
+    if (umem_flags & UMEM_BACKGROUND)
+    {
+        background_start();
+    }
+}
+
+static int heap_init(void *allocated_memory, size_t sizeOfRegion, int algo)
+{
+    // everything past getting hold of the memory, shared by umeminit and
+    // umeminit_buffer
+    allocationAlgo = algo & UMEM_ALGO_MASK;
+    umem_flags = algo & ~UMEM_ALGO_MASK;
+
+    // set list head and size
+    list_head = (node_t *)allocated_memory;
+    list_head->size = sizeOfRegion;
+    list_head->next = NULL; // set next to null
+    // setting this for stat purposes
+    current_free = sizeOfRegion;
+    region_start = allocated_memory;
+    region_size = sizeOfRegion;
+
+    // the table stands in for every header, so the modes that keep state in
+    // headers go unused; buddy and TLSF fall back to best fit on its list
+    if (umem_flags & UMEM_OUT_OF_BAND)
+    {
+        // callers asking for the caches or the thread still share the heap
+        if (umem_flags & (UMEM_PERCPU | UMEM_BACKGROUND | UMEM_THREAD_SPANS))
+        {
+            umem_flags |= UMEM_THREADED;
+        }
+        umem_flags &= ~(UMEM_SIZE_INDEX | UMEM_SMALL_BITMAP | UMEM_QUICK_BINS | UMEM_SIZE_CLASSES |
+                        UMEM_PERCPU | UMEM_BACKGROUND | UMEM_THREAD_SPANS);
+        if (allocationAlgo == BUDDY || allocationAlgo == TLSF)
+        {
+            allocationAlgo = BEST_FIT;
+        }
+        if (oob_init() != 0)
+        {
+            // too small for the table and a block, leave no heap behind
+            list_head = NULL;
+            current_free = 0;
+            region_start = NULL;
+            region_size = 0;
+            return -1;
+        }
+    }
+
+    // TLSF keeps its own lists, the single list and what hangs off it go unused
+    if (allocationAlgo == TLSF)
+    {
+        umem_flags &= ~(UMEM_SIZE_INDEX | UMEM_ADAPTIVE);
+        tlsf_init();
+        tlsf_adopt_list();
+    }
+
+    setup_modes(sizeOfRegion);
+    return 0;
+}
+
+int umeminit(size_t sizeOfRegion, int algo)
+{
+    if (list_head != NULL)
+    {
+        return 0;
+    }
+
+    int fd = open("/dev/zero", O_RDWR);
+    void *allocated_memory = mmap(NULL, sizeOfRegion, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (allocated_memory == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    if (heap_init(allocated_memory, sizeOfRegion, algo) != 0)
+    {
+        munmap(allocated_memory, sizeOfRegion);
+        return -1;
+    }
+    return 0;
+}
+
+int umeminit_buffer(void *buf, size_t len, int algo)
+{
+    if (list_head != NULL)
+    {
+        return 0;
+    }
+
+    // trim the buffer to whole granules, so blocks and table payloads
+    // start aligned whatever the caller passed in
+    uintptr_t start = ((uintptr_t)buf + OOB_GRANULE - 1) & ~(uintptr_t)(OOB_GRANULE - 1);
+    if (buf == NULL || len < start - (uintptr_t)buf + MIN_BLOCK_SIZE)
+    {
+        return -1;
+    }
+    len = (len - (start - (uintptr_t)buf)) & ~(size_t)(OOB_GRANULE - 1);
+    if (heap_init((void *)start, len, algo) != 0)
+    {
+        return -1;
+    }
+    heap_buffer = true;
+    return 0;
+}
+
+static long file_offset(void *ptr)
+{
+    return ptr != NULL ? (char *)ptr - (char *)file_header : 0;
+}
+
+static void *file_pointer(long offset)
+{
+    return offset != 0 ? (char *)file_header + offset : NULL;
+}
+
+// free list links: every process maps a shared heap wherever it lands, so
+// there they stay offsets into the object and are turned into pointers at
+// each step along the list
+static node_t *list_next(node_t *node)
+{
+    return heap_shared ? file_pointer((long)node->next) : node->next;
+}
+
+static void list_link(node_t *node, node_t *next)
+{
+    node->next = heap_shared ? (node_t *)file_offset(next) : next;
+}
+
+static void file_recover()
+{
+    // the list links can't be trusted after a crash, but block sizes chain
+    // from one end of the region to the other. MAGIC marks the blocks still
+    // handed out; free nodes and blocks parked in quick bins or the remote
+    // queue all go back on a fresh list
+    char *region_end = region_start + region_size;
+    char *pos = region_start;
+    node_t *tail = NULL;
+    list_head = NULL;
+    num_allocs = 0;
+    num_deallocs = 0;
+    current_allocated = 0;
+    current_free = 0;
+
+    while (pos < region_end)
+    {
+        header_t *block = (header_t *)pos;
+        long size = block->size;
+        if (size < (long)sizeof(node_t) || size > region_end - pos)
+        {
+            fprintf(stderr, "Error: Heap file damaged at offset %ld, dropping the rest\n", file_offset(pos));
+            size = region_end - pos;
+            block->magic = 0;
+        }
+
+        if (block->magic == MAGIC)
+        {
+            current_allocated += size - sizeof(header_t) - GUARD_BYTES;
+            num_allocs++;
+        }
+        else if (tail != NULL && (char *)tail + tail->size == pos)
+        {
+            tail->size += size;
+            current_free += size;
+        }
+        else
+        {
+            node_t *free_block = init_free_block(block, size);
+            if (tail != NULL)
+            {
+                list_link(tail, free_block);
+            }
+            else
+            {
+                list_head = free_block;
+            }
+            tail = free_block;
+            current_free += size;
+        }
+        pos += size;
+    }
+}
+
+static void shared_load()
+{
+    // the links are offsets for good, only the head and the counters are
+    // copied in and out around each hold
+    file_header_t *fh = file_header;
+    list_head = file_pointer(fh->head);
+    last_allocation = file_pointer(fh->cursor);
+    num_allocs = fh->num_allocs;
+    num_deallocs = fh->num_deallocs;
+    current_allocated = fh->current_allocated;
+    current_free = fh->current_free;
+    fragmentation = fh->fragmentation;
+}
+
+static void shared_store()
+{
+    file_header_t *fh = file_header;
+    fh->head = file_offset(list_head);
+    fh->cursor = file_offset(last_allocation);
+    fh->num_allocs = num_allocs;
+    fh->num_deallocs = num_deallocs;
+    fh->current_allocated = current_allocated;
+    fh->current_free = current_free;
+    fh->fragmentation = fragmentation;
+}
+
+static void shared_lock()
+{
+    // only the outermost hold moves the heap state in and out
+    if (shared_depth++ > 0)
+    {
+        return;
+    }
+    if (pthread_mutex_lock(&file_header->lock) == EOWNERDEAD)
+    {
+        // the last holder died mid-update, its links can't be trusted
+        pthread_mutex_consistent(&file_header->lock);
+        file_recover();
+        last_allocation = NULL;
+        return;
+    }
+    shared_load();
+}
+
+static void shared_unlock()
+{
+    if (--shared_depth > 0)
+    {
+        return;
+    }
+    shared_store();
+    pthread_mutex_unlock(&file_header->lock);
+}
+
+int umeminit_shared(const char *name, size_t sizeOfRegion, int algo)
+{
+    if (list_head != NULL)
+    {
+        return 0;
+    }
+
+    // the first process in creates and formats the object
+    bool fresh = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+        fresh = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0)
+    {
+        perror(name);
+        return -1;
+    }
+
+    file_header_t *fh = MAP_FAILED;
+    if (fresh)
+    {
+        if (ftruncate(fd, FILE_HEADER_SIZE + sizeOfRegion) == 0)
+        {
+            fh = mmap(NULL, FILE_HEADER_SIZE + sizeOfRegion, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+    }
+    else
+    {
+        // wait for the creator to publish the magic, then map the whole
+        // object; the links are offsets, so any address will do
+        struct stat st;
+        file_header_t *peek = MAP_FAILED;
+        for (int i = 0; i < SHARED_ATTACH_TRIES && peek == MAP_FAILED; i++)
+        {
+            if (fstat(fd, &st) == 0 && st.st_size >= FILE_HEADER_SIZE)
+            {
+                peek = mmap(NULL, FILE_HEADER_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+            }
+            else
+            {
+                usleep(1000);
+            }
+        }
+        for (int i = 0; peek != MAP_FAILED && i < SHARED_ATTACH_TRIES; i++)
+        {
+            if (__atomic_load_n(&peek->magic, __ATOMIC_ACQUIRE) == FILE_MAGIC)
+            {
+                sizeOfRegion = peek->region_size;
+                fh = mmap(NULL, FILE_HEADER_SIZE + sizeOfRegion, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (fh == MAP_FAILED)
+                {
+                    perror("mmap");
+                }
+                break;
+            }
+            usleep(1000);
+        }
+        if (peek != MAP_FAILED)
+        {
+            munmap(peek, FILE_HEADER_SIZE);
+        }
+    }
+    close(fd);
+    if (fh == MAP_FAILED)
+    {
+        if (fresh)
+        {
+            perror("mmap");
+            shm_unlink(name);
+        }
+        return -1;
+    }
+
+    // TLSF's lists are per process too, best fit is its nearest list policy
+    allocationAlgo = (algo & UMEM_ALGO_MASK) == TLSF ? BEST_FIT : algo & UMEM_ALGO_MASK;
+    // the index, bins, runs and remote queue are per process and would go
+    // stale as soon as another process touched the list
+    umem_flags = algo & UMEM_ADAPTIVE;
+    file_header = fh;
+    heap_shared = true;
+    region_start = (char *)fh + FILE_HEADER_SIZE;
+    region_size = sizeOfRegion;
+
+    if (fresh)
+    {
+        fh->version = FILE_VERSION;
+        fh->region_size = sizeOfRegion;
+
+        // robust, so a process dying with the lock held doesn't wedge the rest
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&fh->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        node_t *head = (node_t *)region_start;
+        head->size = sizeOfRegion;
+        head->next = NULL;
+        fh->head = file_offset(head);
+        fh->current_free = sizeOfRegion;
+        __atomic_store_n(&fh->magic, FILE_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    // pick up the current state so the stats read right before the first call
+    heap_lock_acquire();
+    heap_lock_release();
+    return 0;
+}
+
+int umeminit_file(const char *path, size_t sizeOfRegion, int algo)
+{
+    if (list_head != NULL)
+    {
+        return 0;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    // an existing file keeps the size it was created with
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    bool fresh = st.st_size == 0;
+    if (fresh && ftruncate(fd, FILE_HEADER_SIZE + sizeOfRegion) != 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if (!fresh)
+    {
+        sizeOfRegion = st.st_size > FILE_HEADER_SIZE ? st.st_size - FILE_HEADER_SIZE : 0;
+    }
+
+    void *mapping = mmap(NULL, FILE_HEADER_SIZE + sizeOfRegion, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+
+    file_header_t *fh = mapping;
+    if (!fresh && (fh->magic != FILE_MAGIC || fh->version != FILE_VERSION ||
+                   fh->region_size != (long)sizeOfRegion))
+    {
+        fprintf(stderr, "Error: %s is not a umem heap file\n", path);
+        munmap(mapping, FILE_HEADER_SIZE + sizeOfRegion);
+        return -1;
+    }
+
+    // TLSF's lists live outside the file as well, best fit is the nearest
+    // policy that keeps everything on the one list
+    allocationAlgo = (algo & UMEM_ALGO_MASK) == TLSF ? BEST_FIT : algo & UMEM_ALGO_MASK;
+    // run descriptors, caches and the maintenance thread live outside the
+    // file and would not survive a restart; recovery scans for headers
+    umem_flags = algo & ~UMEM_ALGO_MASK &
+                 ~(UMEM_SMALL_BITMAP | UMEM_SIZE_CLASSES | UMEM_PERCPU | UMEM_BACKGROUND | UMEM_OUT_OF_BAND |
+                   UMEM_THREAD_SPANS);
+    file_header = fh;
+    region_start = (char *)mapping + FILE_HEADER_SIZE;
+    region_size = sizeOfRegion;
+
+    if (fresh)
+    {
+        fh->magic = FILE_MAGIC;
+        fh->version = FILE_VERSION;
+        fh->region_size = sizeOfRegion;
+        list_head = (node_t *)region_start;
+        list_head->size = sizeOfRegion;
+        list_head->next = NULL;
+        current_free = sizeOfRegion;
+    }
+    else if (fh->clean)
+    {
+        // turn the stored offsets back into pointers for this mapping
+        list_head = file_pointer(fh->head);
+        for (node_t *current = list_head; current != NULL; current = current->next)
+        {
+            current->next = file_pointer((long)current->next);
+        }
+        num_allocs = fh->num_allocs;
+        num_deallocs = fh->num_deallocs;
+        current_allocated = fh->current_allocated;
+        current_free = fh->current_free;
+    }
+    else
+    {
+        file_recover();
+    }
+
+    // from here on a crash leaves the flag clear and the next open recovers
+    fh->clean = 0;
+    setup_modes(sizeOfRegion);
+    if (list_head != NULL)
+    {
+        calculate_fragmentation();
+    }
+    return 0;
+}
+
+int umem_close()
+{
+    if (heap_buffer)
+    {
+        // the memory is the caller's, only forget the heap on it
+        region_start = NULL;
+        region_size = 0;
+        reset_values();
+        return 0;
+    }
+    if (file_header == NULL)
+    {
+        return -1;
+    }
+
+    if (heap_shared)
+    {
+        // the heap lives on in the other processes, only detach from it
+        munmap(file_header, FILE_HEADER_SIZE + region_size);
+        file_header = NULL;
+        heap_shared = false;
+        region_start = NULL;
+        region_size = 0;
+        reset_values();
+        return 0;
+    }
+
+    heap_lock_acquire();
+    remote_drain();
+    if (quick_bytes != 0)
+    {
+        umem_consolidate();
+    }
+
+    // store the links as offsets, the next open may map the file elsewhere
+    file_header_t *fh = file_header;
+    fh->head = file_offset(list_head);
+    node_t *current = list_head;
+    while (current != NULL)
+    {
+        node_t *next = current->next;
+        current->next = (node_t *)file_offset(next);
+        current = next;
+    }
+    fh->num_allocs = num_allocs;
+    fh->num_deallocs = num_deallocs;
+    fh->current_allocated = current_allocated;
+    fh->current_free = current_free;
+
+    // the flag only goes out once everything it vouches for is on disk
+    msync(fh, FILE_HEADER_SIZE + region_size, MS_SYNC);
+    fh->clean = 1;
+    msync(fh, FILE_HEADER_SIZE, MS_SYNC);
+    heap_lock_release();
+
+    munmap(fh, FILE_HEADER_SIZE + region_size);
+    file_header = NULL;
+    region_start = NULL;
+    region_size = 0;
+    reset_values();
+    return 0;
+}
+
+void umem_set_root(void *ptr)
+{
+    if (file_header != NULL)
+    {
+        file_header->root = file_offset(ptr);
+    }
+}
+
+void *umem_get_root()
+{
+    return file_header != NULL ? file_pointer(file_header->root) : NULL;
+}
+
+long umem_offset(void *ptr)
+{
+    return file_header != NULL ? file_offset(ptr) : 0;
+}
+
+void *umem_pointer(long offset)
+{
+    return file_header != NULL ? file_pointer(offset) : NULL;
+}
+
+node_t *find_prev(node_t *block)
+{
+    // the index holds the free list in address order, no walk needed
+    if (index_blocks != NULL)
+    {
+        int i = index_position(block);
+        return i > 0 ? index_blocks[i - 1] : NULL;
+    }
+
+    // keep searching until we find the block that points to our target
+    node_t *prev = list_head;
+    while (prev && list_next(prev) != block)
+    {
+        prev = list_next(prev);
+    }
+    return prev;
+}
+
+void *allocate_block(node_t *block, size_t size)
+{
+
+    size_t rounded_size = size + sizeof(header_t);
+    size_t remaining_size = block->size - rounded_size;
+
+    // save the next pointer before modifying the block
+    node_t *saved_next = list_next(block);
+
+    // now set the magic number
+    ((header_t *)block)->magic = MAGIC;
+
+    // handles block splitting
+    if (remaining_size >= sizeof(node_t)) // should i be adding 8 bytes to this as well?
+    {
+        // create a new block at the end of the allocated block
+        node_t *new_node = (node_t *)((char *)block + rounded_size);
+        new_node->size = remaining_size;
+
+        // if the block we're splitting is the head of the free list
+        if (block == list_head)
+        {
+            list_link(new_node, saved_next); // Use saved_next pointer
+            list_head = new_node;
+        }
+        else
+        {
+            list_link(new_node, saved_next); // Use saved_next pointer
+
+            // find the block that points to our target
+            node_t *prev = find_prev(block);
+            // if we find it, connect it to our new free block
+            if (prev)
+            {
+                list_link(prev, new_node);
+            }
+        }
+
+        // set the size of the allocated block
+        block->size = rounded_size;
+
+        index_update(block, new_node);
+
+        // the remainder takes the block's place, so next fit resumes there
+        if (last_allocation == block)
+        {
+            last_allocation = new_node;
+        }
+    }
+    // if block is not big enough to split
+    else
+    {
+        // remove the whole block from the list
+        if (block == list_head)
+        {
+            list_head = saved_next; // use saved_next pointer
+        }
+        else
+        {
+            node_t *prev = find_prev(block);
+            if (prev)
+            {
+                list_link(prev, saved_next); // use saved_next pointer
+            }
+        }
+        index_remove(block);
+
+        // the leftover stays with the block, count it as handed out
+        current_allocated += remaining_size;
+        current_free -= remaining_size;
+
+        // keep the next fit cursor on a block that is still free
+        if (last_allocation == block)
+        {
+            last_allocation = saved_next != NULL ? saved_next : list_head;
+        }
+    }
+
+    // update stats
+    // it is my understanding that this should NOT include the size of the header
+    current_allocated += size - GUARD_BYTES; // update with "actual" bytes returned to user
+    current_free -= rounded_size;
+    num_allocs++;
+
+    return (void *)((char *)block + sizeof(header_t));
+}
+
+void *best(size_t size)
+{
+    // 8 byte alignment
+    size_t required_size = ((size + sizeof(header_t) + 7) / 8) * 8;
+    node_t *current = list_head;
+    node_t *best_fit = NULL;
+
+    if (index_blocks != NULL)
+    {
+        best_fit = index_best(required_size);
+        current = NULL; // skip the list walk
+    }
+
+    // traverse free list
+    while (current != NULL)
+    {
+        search_steps++;
+        // if the block is bigger than the size request aligned for 8 bytes
+        if (current->size >= required_size)
+        {
+            // if we haven't found a block yet or the current block is smaller than the best fit
+            if (best_fit == NULL ||
+                current->size < best_fit->size ||
+                (current->size == best_fit->size && current < best_fit))
+            {
+                // set the best fit to the current block
+                best_fit = current;
+            }
+        }
+        current = list_next(current);
+    }
+
+    // if we found a block return it
+    if (best_fit != NULL)
+    {
+
+        return allocate_block(best_fit, size);
+    }
+    return NULL;
+}
+
+void *worst(size_t size)
+{
+
+    // 8 byte alignment
+    size_t required_size = ((size + sizeof(header_t) + 7) / 8) * 8;
+    node_t *current = list_head;
+    node_t *worst_fit = NULL;
+
+    if (index_blocks != NULL)
+    {
+        worst_fit = index_worst(required_size);
+        current = NULL; // skip the list walk
+    }
+
+    // traverse free list
+    while (current != NULL)
+    {
+        search_steps++;
+        // if the block is bigger than the size request aligned for 8 bytes
+        if (current->size >= required_size)
+        {
+            // if we haven't found a block yet or the current block is bigger than the worst fit
+            if (worst_fit == NULL || current->size > worst_fit->size)
+            {
+                worst_fit = current;
+            }
+        }
+        current = list_next(current);
+    }
+    // if we found a block return it
+    if (worst_fit != NULL)
+    {
+        return allocate_block(worst_fit, size);
+    }
+    return NULL;
+}
+
+void *first(size_t size)
+{
+    // 8 byte alignment
+    size_t required_size = ((size + sizeof(header_t) + 7) / 8) * 8;
+    node_t *current = list_head;
+    node_t *first = NULL;
+
+    if (index_blocks != NULL)
+    {
+        first = index_first(required_size);
+        current = NULL; // skip the list walk
+    }
+
+    // traverse free list
+    while (current != NULL)
+    {
+        search_steps++;
+        // if the block is bigger than the size request aligned for 8 bytes
+        if (current->size >= required_size)
+        {
+            // set the first block that fits the size
+            first = current;
+            break;
+        }
+        current = list_next(current);
+    }
+
+    // if we found a block return it
+    if (first != NULL)
+    {
+        return allocate_block(first, size);
+    }
+    return NULL;
+}
+
+void *next(size_t size)
+{
+
+    // 8 byte alignment
+    size_t required_size = ((size + sizeof(header_t) + 7) / 8) * 8;
+
+    if (list_head == NULL)
+        return NULL;
+
+    // allocate_block and the free path move the cursor along with the node
+    // it points at, so it is always either NULL or a member of the free list
+    if (last_allocation == NULL)
+    {
+        last_allocation = list_head;
+    }
+
+    node_t *start = last_allocation;
+    node_t *current = start;
+
+    do
+    {
+        search_steps++;
+        // checking to see what the last allocation was
+        // if the current block is big enough for our request
+        if (current->size >= required_size)
+        {
+            // save where to start next search before we modify the block
+            if (list_next(current) != NULL)
+            {
+                last_allocation = list_next(current);
+            }
+            else
+            {
+                last_allocation = list_head;
+            }
+
+            return allocate_block(current, size);
+        }
+
+        // if there's a next block then move to it, otherwise current is the head
+        if (list_next(current) != NULL)
+        {
+            current = list_next(current);
+        }
+        else
+        {
+            current = list_head;
+        }
+
+    } while (current != start);
+
+    // if we get here, we've gone through the whole list without finding space
+    last_allocation = NULL; // Reset for next time
+    return NULL;
+}
+
+void *policy_alloc(size_t size)
+{
+    void *allocated_memory = NULL;
+<<<<<<< HEAD
+    // 8 byte alignment
+    size_t aligned_size = ((size + 7) / 8) * 8;
+
+    if (aligned_size == 0) // handle 0 size
+=======
+
+    if (size == 0) // handle 0 size
+>>>>>>> afbf9b4... umalloc final
+    {
+        return NULL;
+    }
+
+    // determine which algorithm we use
+    switch (allocationAlgo)
+    {
+    case BEST_FIT:
+<<<<<<< HEAD
+        allocated_memory = best(aligned_size);
+        break;
+    case WORST_FIT:
+        allocated_memory = worst(aligned_size);
+        break;
+    case FIRST_FIT:
+        allocated_memory = first(aligned_size);
+        break;
+    case NEXT_FIT:
+        allocated_memory = next(aligned_size);
+=======
+        allocated_memory = best(size);
+        break;
+    case WORST_FIT:
+        allocated_memory = worst(size);
+        break;
+    case FIRST_FIT:
+        allocated_memory = first(size);
+        break;
+    case NEXT_FIT:
+        allocated_memory = next(size);
+>>>>>>> afbf9b4... umalloc final
+        break;
+    default:
+        return NULL;
+    }
+
+    // set header if allocation was successful
+    if (allocated_memory != NULL)
+    {
+        header_t *allocated_header = (header_t *)((char *)allocated_memory - sizeof(header_t));
+    }
+    return allocated_memory;
+}
+
+void *fit_alloc(size_t size)
+{
+    // TLSF and the table sit beside the list policies rather than in their switch
+    if (oob_entries != NULL)
+    {
+        return oob_alloc(size);
+    }
+    return allocationAlgo == TLSF ? tlsf_alloc(size) : policy_alloc(size);
+}
+
+// adaptive policy: counters for the current window and the candidate
+// policy that has been winning it
+static int adapt_allocs = 0;
+static int adapt_failures = 0;
+static long adapt_steps_start = 0;
+static int adapt_candidate = 0;
+static int adapt_votes = 0;
+
+// placement hints: long-lived and cold blocks are cut from the top of the
+// region downward, hot ones packed upward from a cursor, and short-lived
+// ones left to the policy, so churn at the bottom coalesces without
+// long-lived blocks pinning the free space between it
+static char *hot_cursor = NULL; // just past the last hot block
+
+static void *top_alloc(size_t size)
+{
+    // the highest free block that fits gives up its tail
+    size_t required_size = size + sizeof(header_t);
+    node_t *top = NULL;
+    if (index_blocks != NULL)
+    {
+        for (int i = index_count - 1; i >= 0 && top == NULL; i--)
+        {
+            search_steps++;
+            if (index_sizes[i] >= required_size)
+            {
+                top = index_blocks[i];
+            }
+        }
+    }
+    else
+    {
+        for (node_t *current = list_head; current != NULL; current = list_next(current))
+        {
+            search_steps++;
+            if ((size_t)current->size >= required_size)
+            {
+                top = current;
+            }
+        }
+    }
+    if (top == NULL)
+    {
+        return NULL;
+    }
+
+    // a remainder too small to list goes with the block, as in allocate_block
+    if (top->size - required_size < sizeof(node_t))
+    {
+        return allocate_block(top, size);
+    }
+    top->size -= required_size;
+    index_update(top, top);
+    header_t *header = (header_t *)((char *)top + top->size);
+    header->size = required_size;
+    header->magic = MAGIC;
+    current_allocated += size - GUARD_BYTES;
+    current_free -= required_size;
+    num_allocs++;
+    return (char *)header + sizeof(header_t);
+}
+
+static void *hot_alloc(size_t size)
+{
+    // first fit from the cursor on, then from the bottom, so hot blocks
+    // land next to each other until the space behind them runs out
+    size_t required_size = size + sizeof(header_t);
+    node_t *hot = NULL;
+    for (char *from = hot_cursor;; from = NULL)
+    {
+        node_t *current = list_head;
+        if (index_blocks != NULL)
+        {
+            int i = index_position((node_t *)from);
+            for (; i < index_count && hot == NULL; i++)
+            {
+                search_steps++;
+                if (index_sizes[i] >= required_size)
+                {
+                    hot = index_blocks[i];
+                }
+            }
+            current = NULL;
+        }
+        for (; current != NULL && hot == NULL; current = list_next(current))
+        {
+            search_steps++;
+            if ((char *)current >= from && (size_t)current->size >= required_size)
+            {
+                hot = current;
+            }
+        }
+        if (hot != NULL || from == NULL)
+        {
+            break;
+        }
+    }
+    if (hot == NULL)
+    {
+        return NULL;
+    }
+    void *ptr = allocate_block(hot, size);
+    hot_cursor = (char *)hot + ((header_t *)hot)->size;
+    return ptr;
+}
+
+static void adapt_observe(bool failed)
+{
+    adapt_allocs++;
+    adapt_failures += failed;
+    if (adapt_allocs < ADAPT_WINDOW)
+    {
+        return;
+    }
+
+    float average_search = (float)(search_steps - adapt_steps_start) / adapt_allocs;
+    int want = allocationAlgo;
+
+    // fragmentation or failures: spend search time on tighter packing.
+    // the gap between FRAG_HIGH and FRAG_LOW keeps it from flapping
+    if (adapt_failures > 0 || fragmentation > ADAPT_FRAG_HIGH)
+    {
+        want = BEST_FIT;
+    }
+    else if (allocationAlgo != BEST_FIT || fragmentation < ADAPT_FRAG_LOW)
+    {
+        // packing is fine: long searches favour the roving cursor, short
+        // ones can afford to keep low addresses dense
+        want = average_search > ADAPT_LONG_SEARCH ? NEXT_FIT : FIRST_FIT;
+
+        // nearly everything free: leave big remainders behind
+        if (current_free > region_size / 4 * 3 && fragmentation < 1.0)
+        {
+            want = WORST_FIT;
+        }
+    }
+
+    // only switch after several windows in a row agree
+    if (want == allocationAlgo)
+    {
+        adapt_votes = 0;
+    }
+    else if (want == adapt_candidate)
+    {
+        if (++adapt_votes >= ADAPT_CONFIRM)
+        {
+            allocationAlgo = want;
+            adapt_votes = 0;
+        }
+    }
+    else
+    {
+        adapt_candidate = want;
+        adapt_votes = 1;
+    }
+
+    adapt_allocs = 0;
+    adapt_failures = 0;
+    adapt_steps_start = search_steps;
+}
+
+int umem_policy()
+{
+    return allocationAlgo;
+}
+
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+static void guard_set(void *ptr)
+{
+    // the table knows where a block ends without a header
+    if (ptr != NULL && oob_entries != NULL)
+    {
+        *(long *)((char *)ptr + oob_usable(ptr) - sizeof(long)) = GUARD_CANARY;
+        return;
+    }
+    // headerless slots have no room set aside for a canary
+    if (ptr != NULL && small_run_of(ptr) == NULL)
+    {
+        header_t *header = (header_t *)((char *)ptr - sizeof(header_t));
+        *(long *)((char *)header + header->size - sizeof(long)) = GUARD_CANARY;
+    }
+}
+
+static void validate_guard(void *ptr, header_t *header)
+{
+    // look at the pointer before trusting anything its header says
+    if ((char *)header < region_start || (char *)ptr >= region_start + region_size ||
+        ((uintptr_t)ptr & 7) != 0)
+    {
+        fprintf(stderr, "Error: Invalid pointer %p\n", ptr);
+        exit(1);
+    }
+    if (header->magic != MAGIC && header->magic != PROF_MAGIC)
+    {
+        return; // the magic checks report this one
+    }
+    if (header->size < (long)(sizeof(header_t) + sizeof(long)) ||
+        header->size > region_start + region_size - (char *)header)
+    {
+        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
+        exit(1);
+    }
+    if (*(long *)((char *)header + header->size - sizeof(long)) != GUARD_CANARY)
+    {
+        fprintf(stderr, "Error: Buffer overflow detected at block %p\n", ptr);
+        exit(1);
+    }
+}
+#endif
+
+#if PCPU_RSEQ
+// the kernel sends a thread that is preempted, migrated or signalled
+// between 1 and 2 to the abort handler at 4, which starts over from 6, so
+// the store before 2 commits only if the whole sequence ran on one CPU.
+// the handler must follow the signature glibc registered the thread with
+#define PCPU_RSEQ_BEGIN                                  \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                 \
+    ".balign 32\n\t"                                     \
+    "9:\n\t"                                             \
+    ".long 0, 0\n\t"                                     \
+    ".quad 1f, 2f - 1f, 4f\n\t"                          \
+    ".popsection\n\t"                                    \
+    "6:\n\t"                                             \
+    "leaq 9b(%%rip), %%rax\n\t"                          \
+    "movq %%rax, %%fs:%c[cs_field](%[rseq])\n\t"         \
+    "1:\n\t"                                             \
+    "movl %%fs:%c[cpu_field](%[rseq]), %%eax\n\t"        \
+    "imulq %[stride], %%rax, %%rax\n\t"                  \
+    "addq %[caches], %%rax\n\t"
+
+#define PCPU_RSEQ_END                                    \
+    "2:\n\t"                                             \
+    ".pushsection __rseq_failure, \"ax\"\n\t"            \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                         \
+    ".long 0x53053053\n\t"                               \
+    "4:\n\t"                                             \
+    "jmp 6b\n\t"                                         \
+    ".popsection\n\t"
+
+#define PCPU_RSEQ_CACHE_INPUTS                                                         \
+    [rseq] "r"(__rseq_offset), [cs_field] "i"(offsetof(struct rseq, rseq_cs)),         \
+        [cpu_field] "i"(offsetof(struct rseq, cpu_id)), [stride] "i"(sizeof(pcpu_cache_t)), \
+        [caches] "r"(pcpu_caches)
+
+#define PCPU_RSEQ_INPUTS(class)                                                        \
+    PCPU_RSEQ_CACHE_INPUTS, [count] "r"((long)((class) * sizeof(long))),               \
+        [slots] "r"((long)(offsetof(pcpu_cache_t, slots) + (class) * PCPU_DEPTH * sizeof(void *)))
+
+static void *pcpu_rseq_pop(int class)
+{
+    void *ptr;
+    __asm__ __volatile__(
+        PCPU_RSEQ_BEGIN
+        "xorl %k[ptr], %k[ptr]\n\t"
+        "movq (%%rax,%[count]), %%rdx\n\t"
+        "testq %%rdx, %%rdx\n\t"
+        "jz 2f\n\t"
+        "leaq (%%rax,%[slots]), %[ptr]\n\t"
+        "movq -8(%[ptr],%%rdx,8), %[ptr]\n\t"
+        "decq %%rdx\n\t"
+        "movq %%rdx, (%%rax,%[count])\n\t"
+        PCPU_RSEQ_END
+        : [ptr] "=&r"(ptr)
+        : PCPU_RSEQ_INPUTS(class)
+        : "rax", "rdx", "cc", "memory");
+    return ptr;
+}
+
+static bool pcpu_rseq_push(int class, void *ptr)
+{
+    long pushed;
+    __asm__ __volatile__(
+        PCPU_RSEQ_BEGIN
+        "xorl %k[pushed], %k[pushed]\n\t"
+        "movq (%%rax,%[count]), %%rdx\n\t"
+        "cmpq %[depth], %%rdx\n\t"
+        "jae 2f\n\t"
+        "leaq (%%rax,%[slots]), %[pushed]\n\t"
+        "movq %[ptr], (%[pushed],%%rdx,8)\n\t"
+        "movl $1, %k[pushed]\n\t"
+        "incq %%rdx\n\t"
+        "movq %%rdx, (%%rax,%[count])\n\t"
+        PCPU_RSEQ_END
+        : [pushed] "=&r"(pushed)
+        : PCPU_RSEQ_INPUTS(class), [depth] "i"(PCPU_DEPTH), [ptr] "r"(ptr)
+        : "rax", "rdx", "cc", "memory");
+    return pushed != 0;
+}
+
+static void pcpu_rseq_bump(long field)
+{
+    // one counter of this CPU's cache; the increment is a single
+    // instruction and the commit, so a restart never counts twice
+    __asm__ __volatile__(
+        PCPU_RSEQ_BEGIN
+        "incq (%%rax,%[field])\n\t"
+        PCPU_RSEQ_END
+        :
+        : PCPU_RSEQ_CACHE_INPUTS, [field] "r"(field)
+        : "rax", "cc", "memory");
+}
+#endif
+
+static pcpu_cache_t *pcpu_locked_cache()
+{
+    // hand each thread a cache on first use, round robin
+    if (pcpu_ticket < 0)
+    {
+        pcpu_ticket = atomic_fetch_add_explicit(&pcpu_tickets, 1, memory_order_relaxed) & INT32_MAX;
+    }
+    pcpu_cache_t *cache = &pcpu_caches[pcpu_ticket % pcpu_count];
+    pthread_mutex_lock(&cache->lock);
+    return cache;
+}
+
+static void *pcpu_pop(int class, bool hit)
+{
+    // a hit is a umalloc served from the cache and counts on it
+#if PCPU_RSEQ
+    if (pcpu_rseq)
+    {
+        void *ptr = pcpu_rseq_pop(class);
+        if (ptr != NULL && hit)
+        {
+            pcpu_rseq_bump(offsetof(pcpu_cache_t, allocs));
+        }
+        return ptr;
+    }
+#endif
+    void *ptr = NULL;
+    pcpu_cache_t *cache = pcpu_locked_cache();
+    if (cache->count[class] > 0)
+    {
+        ptr = cache->slots[class][--cache->count[class]];
+        cache->allocs += hit;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return ptr;
+}
+
+static bool pcpu_push(int class, void *ptr, bool hit)
+{
+    // a hit is a ufree kept in the cache and counts on it
+#if PCPU_RSEQ
+    if (pcpu_rseq)
+    {
+        bool pushed = pcpu_rseq_push(class, ptr);
+        if (pushed && hit)
+        {
+            pcpu_rseq_bump(offsetof(pcpu_cache_t, deallocs));
+        }
+        return pushed;
+    }
+#endif
+    bool pushed = false;
+    pcpu_cache_t *cache = pcpu_locked_cache();
+    if (cache->count[class] < PCPU_DEPTH)
+    {
+        cache->slots[class][cache->count[class]++] = ptr;
+        cache->deallocs += hit;
+        pushed = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return pushed;
+}
+
+static void pcpu_return(void **batch, int count, int uncounted)
+{
+    // cached blocks still count as allocated, this is their real free. the
+    // first uncounted blocks are frees no cache has counted yet
+    if (count == 0)
+    {
+        return;
+    }
+    heap_lock_acquire();
+    for (int i = 0; i < count; i++)
+    {
+        ((header_t *)((char *)batch[i] - sizeof(header_t)))->magic = MAGIC;
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+        guard_set(batch[i]); // checked on the way into the cache
+#endif
+        free_block(batch[i]);
+    }
+    num_deallocs -= count - uncounted;
+    heap_lock_release();
+}
+
+static void *pcpu_refill(int class)
+{
+    // one trip to the heap for half a stack, the first block is the caller's
+    size_t size = (class + 1) * PCPU_STEP;
+    void *batch[PCPU_BATCH];
+    int count = 0;
+
+    heap_lock_acquire();
+    remote_drain();
+    while (count < PCPU_BATCH)
+    {
+        void *ptr = quick_bytes != 0 ? quick_alloc(size) : NULL;
+        if (ptr == NULL)
+        {
+            ptr = fit_alloc(size);
+        }
+        if (ptr == NULL)
+        {
+            break;
+        }
+        batch[count++] = ptr;
+    }
+    // the caller's umalloc counts here, the rest when a hit hands them out
+    num_allocs -= count > 1 ? count - 1 : 0;
+    pcpu_refills++;
+    heap_lock_release();
+
+    int kept = 1;
+    while (kept < count)
+    {
+        ((header_t *)((char *)batch[kept] - sizeof(header_t)))->magic = PCPU_MAGIC;
+        if (!pcpu_push(class, batch[kept], false))
+        {
+            break; // another thread on this CPU filled it meanwhile
+        }
+        kept++;
+    }
+    if (count > 1)
+    {
+        pcpu_return(batch + kept, count - kept, 0);
+    }
+    return count > 0 ? batch[0] : NULL;
+}
+
+static void pcpu_prof_sample(void *ptr, size_t size)
+{
+    // each thread keeps its own countdown over its cache hits, the heap
+    // lock is only taken once it runs out
+    heap_lock_acquire();
+    if (pcpu_prof_armed)
+    {
+        prof_record_alloc(ptr, size);
+    }
+    pcpu_prof_countdown = prof_next_interval();
+    pcpu_prof_armed = true;
+    heap_lock_release();
+}
+
+static void *pcpu_alloc(size_t size)
+{
+    size_t requested = size;
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    size += sizeof(long);
+#endif
+    if (size > PCPU_MAX_SIZE)
+    {
+        return NULL;
+    }
+    int class = (size - 1) / PCPU_STEP;
+    void *ptr = pcpu_pop(class, true);
+    if (ptr == NULL)
+    {
+        ptr = pcpu_refill(class);
+    }
+    if (ptr != NULL)
+    {
+        ((header_t *)((char *)ptr - sizeof(header_t)))->magic = MAGIC;
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+        guard_set(ptr);
+#endif
+        if (prof_rate != 0 && (pcpu_prof_countdown -= (long)requested) < 0)
+        {
+            pcpu_prof_sample(ptr, requested);
+        }
+    }
+    return ptr;
+}
+
+static bool pcpu_free(void *ptr)
+{
+    // slots in bitmap runs have no header to keep the size class in
+    if (small_run_of(ptr) != NULL)
+    {
+        return false;
+    }
+
+    header_t *header = (header_t *)((char *)ptr - sizeof(header_t));
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    validate_guard(ptr, header);
+#endif
+    // only sampled blocks need the profiler's table, and the lock with it
+    if (header->magic == PROF_MAGIC)
+    {
+        heap_lock_acquire();
+        prof_record_free(ptr); // puts MAGIC back
+        heap_lock_release();
+    }
+    if (header->magic == PCPU_MAGIC || header->magic == REMOTE_MAGIC || header->magic == QUICK_MAGIC)
+    {
+        fprintf(stderr, "Error: Double free detected at block %p\n", ptr);
+        exit(1);
+    }
+    size_t capacity = header->size - sizeof(header_t);
+    if (header->magic != MAGIC || capacity < PCPU_STEP || capacity > PCPU_MAX_SIZE)
+    {
+        return false;
+    }
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    memset(ptr, FREE_POISON, capacity - sizeof(long)); // the canary stays for pcpu_return
+#endif
+
+    // a block holds every request of the classes up to its capacity
+    int class = capacity / PCPU_STEP - 1;
+    header->magic = PCPU_MAGIC;
+    if (pcpu_push(class, ptr, true))
+    {
+        return true;
+    }
+
+    // full: send half the stack back to the heap along with this block
+    void *batch[PCPU_BATCH + 1];
+    int count = 0;
+    batch[count++] = ptr;
+    while (count <= PCPU_BATCH && (batch[count] = pcpu_pop(class, false)) != NULL)
+    {
+        count++;
+    }
+    pcpu_return(batch, count, 1);
+    return true;
+}
+
+void umem_cache_flush()
+{
+    // locked caches can all be emptied from here; with rseq only the
+    // calling CPU's, and a thread that migrates part way drains the CPU it
+    // lands on instead
+    if (pcpu_caches == NULL)
+    {
+        return;
+    }
+    heap_lock_acquire();
+    pcpu_fold();
+    heap_lock_release();
+    void *batch[PCPU_DEPTH];
+    for (int class = 0; class < PCPU_CLASSES; class++)
+    {
+        if (pcpu_rseq)
+        {
+            int count = 0;
+            while (count < PCPU_DEPTH && (batch[count] = pcpu_pop(class, false)) != NULL)
+            {
+                count++;
+            }
+            pcpu_return(batch, count, 0);
+            continue;
+        }
+        for (int i = 0; i < pcpu_count; i++)
+        {
+            pcpu_cache_t *cache = &pcpu_caches[i];
+            pthread_mutex_lock(&cache->lock);
+            int count = cache->count[class];
+            memcpy(batch, cache->slots[class], count * sizeof(void *));
+            cache->count[class] = 0;
+            pthread_mutex_unlock(&cache->lock);
+            pcpu_return(batch, count, 0);
+        }
+    }
+}
+
+void *umalloc(size_t size)
+{
+    // small requests try this CPU's cache before going near the heap lock
+    if (pcpu_caches != NULL && size != 0)
+    {
+        void *cached = pcpu_alloc(size);
+        if (cached != NULL)
+        {
+            return cached;
+        }
+    }
+
+    void *allocated_memory = NULL;
+    size_t requested = size;
+    long started = metrics_clock();
+    heap_lock_acquire();
+    long steps_before = search_steps;
+    // the maintenance thread drains the queue, umalloc only dips into it
+    // when it runs out of space
+    if (!(umem_flags & UMEM_BACKGROUND))
+    {
+        remote_drain();
+    }
+
+    // tiny requests go to the bitmap runs when that mode is on; slots
+    // have no canary, so they are sized by the request alone
+    if (small_runs != NULL && size != 0 && size <= SMALL_MAX_SIZE)
+    {
+        allocated_memory = small_alloc(size);
+    }
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    // room for the tail canary
+    if (size != 0)
+    {
+        size += sizeof(long);
+    }
+#endif
+
+    if (allocated_memory == NULL && quick_bytes != 0)
+    {
+        allocated_memory = quick_alloc(size);
+    }
+    if (allocated_memory == NULL)
+    {
+        allocated_memory = fit_alloc(size);
+
+        // out of contiguous space: merge the parked blocks and try again
+        if (allocated_memory == NULL && quick_bytes != 0)
+        {
+            umem_consolidate();
+            allocated_memory = fit_alloc(size);
+        }
+
+        // or in empty runs the slot allocator is holding on to
+        if (allocated_memory == NULL && span_flush())
+        {
+            allocated_memory = fit_alloc(size);
+        }
+
+        // or the space is sitting in this CPU's cache
+        if (allocated_memory == NULL && pcpu_caches != NULL)
+        {
+            umem_cache_flush();
+            allocated_memory = fit_alloc(size);
+        }
+
+        // or in frees the maintenance thread hasn't got to yet
+        if (allocated_memory == NULL && (umem_flags & UMEM_BACKGROUND))
+        {
+            remote_drain();
+            allocated_memory = fit_alloc(size);
+        }
+
+        if ((umem_flags & UMEM_ADAPTIVE) && size != 0)
+        {
+            adapt_observe(allocated_memory == NULL);
+        }
+    }
+
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    guard_set(allocated_memory);
+#endif
+    prof_note_alloc(allocated_memory, requested);
+    metrics_publish(METRICS_ALLOC, started, search_steps - steps_before);
+    heap_lock_release();
+    return allocated_memory;
+}
+
+void *umalloc_hint(size_t size, int hints)
+{
+    // TLSF and the table keep no address order to place by, and slots
+    // and cached blocks are already packed by size
+    bool top = (hints & (UMEM_LONG_LIVED | UMEM_COLD)) != 0;
+    if ((!top && !(hints & UMEM_HOT)) || size == 0 || allocationAlgo == TLSF || oob_entries != NULL ||
+        (small_runs != NULL && size <= SMALL_MAX_SIZE))
+    {
+        return umalloc(size);
+    }
+
+    heap_lock_acquire();
+    if (!(umem_flags & UMEM_BACKGROUND))
+    {
+        remote_drain();
+    }
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    // room for the tail canary
+    size_t aligned_size = ((size + sizeof(long) + 7) / 8) * 8;
+#else
+    size_t aligned_size = ((size + 7) / 8) * 8;
+#endif
+    void *allocated_memory = top ? top_alloc(aligned_size) : hot_alloc(aligned_size);
+    if (allocated_memory != NULL)
+    {
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+        guard_set(allocated_memory);
+#endif
+        prof_note_alloc(allocated_memory, size);
+        metrics_publish(METRICS_SNAPSHOT, 0, 0);
+    }
+    heap_lock_release();
+
+    // umalloc knows where else to look for space
+    return allocated_memory != NULL ? allocated_memory : umalloc(size);
+}
+
+float calculate_fragmentation()
+{
+    if (oob_entries != NULL)
+    {
+        return oob_fragmentation();
+    }
+    if (allocationAlgo == TLSF)
+    {
+        return tlsf_fragmentation();
+    }
+
+    node_t *current = list_head;
+    size_t largest_free = 0;
+    size_t mem_in_small_blocks = 0;
+
+    //  find the largest free block
+    while (current != NULL)
+    {
+        if (largest_free < current->size)
+        {
+            largest_free = current->size;
+        }
+        current = list_next(current);
+    }
+
+    // set threshold for small blocks
+    size_t small_block_def = largest_free / 2;
+    current = list_head;
+
+    // calculate fragmentation
+    while (current != NULL)
+    {
+        if (current->size < small_block_def)
+        {
+            mem_in_small_blocks += current->size;
+        }
+        current = list_next(current);
+    }
+
+    fragmentation = ((float)mem_in_small_blocks / (float)current_free) * 100.0;
+    return fragmentation;
+}
+
+void validate_free_ptr(void *ptr, header_t *header)
+{
+    if (header->magic != MAGIC)
+    {
+        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
+        exit(1);
+    }
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_DEFAULT
+    // the free map already knows, no walk needed
+    if (allocationAlgo == TLSF)
+    {
+        if (tlsf_is_free(header))
+        {
+            fprintf(stderr, "Error: Double free detected at block %p\n", ptr);
+            exit(1);
+        }
+        return;
+    }
+    node_t *check = list_head;
+    while (check != NULL)
+    {
+        if ((void *)check == (void *)header)
+        {
+            fprintf(stderr, "Error: Double free detected at block %p\n", ptr);
+            exit(1);
+        }
+        check = list_next(check);
+    }
+#endif
+}
+
+void update_free_stats(size_t size_to_free)
+{
+    current_free += size_to_free;
+    // current_allocated -= size_to_free;
+    current_allocated -= (size_to_free - sizeof(header_t) - GUARD_BYTES); // update with "actual" bytes returned to user
+    num_deallocs += 1;
+}
+
+void merge_with_next_blocks(node_t *current)
+{
+    // iterate through the free list and merge with the next block if possible
+    while (list_next(current) != NULL &&
+           (char *)current + current->size == (char *)list_next(current))
+    {
+        // the absorbed block can't stay the next fit cursor
+        if (last_allocation == list_next(current))
+        {
+            last_allocation = current;
+        }
+        index_remove(list_next(current));
+        current->size += list_next(current)->size; // merge the two blocks
+        list_link(current, list_next(list_next(current)));  // set the next pointer to the next next block
+        index_update(current, current);
+    }
+}
+
+void insert_block(node_t *free_block, node_t *current, node_t *prev)
+{
+    // insert the block in the free list in address order
+    if (prev == NULL)
+    {
+        list_link(free_block, list_head);
+        list_head = free_block;
+    }
+    else // insert in the middle
+    {
+        list_link(prev, free_block);
+        list_link(free_block, current);
+    }
+}
+
+node_t *init_free_block(header_t *header, size_t size)
+{
+    // initialize a free block
+    node_t *free_block = (node_t *)header;
+    free_block->size = size;
+    list_link(free_block, NULL);
+    return free_block;
+}
+
+void ufree(void *ptr)
+{
+    // if ptr is NULL, return
+    if (ptr == NULL)
+        return;
+
+    if (pcpu_caches != NULL && pcpu_free(ptr))
+    {
+        return;
+    }
+    if (umem_flags & UMEM_BACKGROUND)
+    {
+        background_free(ptr);
+        return;
+    }
+    // the remote queue tags headers, table heaps always free under the lock
+    if ((umem_flags & UMEM_THREADED) && oob_entries == NULL)
+    {
+        // someone else's block: queue it for the owner, never wait on the lock
+        if (!pthread_equal(pthread_self(), heap_owner))
+        {
+            remote_push(ptr);
+            return;
+        }
+        long started = metrics_clock();
+        heap_lock_acquire();
+        remote_drain();
+        free_block(ptr);
+        metrics_publish(METRICS_FREE, started, 0);
+        heap_lock_release();
+        return;
+    }
+    long started = metrics_clock();
+    heap_lock_acquire();
+    free_block(ptr);
+    metrics_publish(METRICS_FREE, started, 0);
+    heap_lock_release();
+}
+
+void free_block(void *ptr)
+{
+    // drop the sample if this block was one
+    if (prof_live_count > 0)
+    {
+        prof_record_free(ptr);
+    }
+    if (oob_entries != NULL)
+    {
+        oob_free(ptr);
+        return;
+    }
+
+    // slots in a bitmap run have no header to look at
+    small_run_t *run = small_run_of(ptr);
+    if (run != NULL)
+    {
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+        memset(ptr, FREE_POISON, run->slot_size);
+#endif
+        small_dealloc(run, ptr);
+        return;
+    }
+
+    // get the header for the current block
+    header_t *header = (header_t *)((char *)ptr - sizeof(header_t));
+
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    validate_guard(ptr, header);
+    if (header->magic == MAGIC)
+    {
+        // stale reads through a dangling pointer see garbage, not old data
+        memset(ptr, FREE_POISON, header->size - sizeof(header_t));
+    }
+#endif
+
+    // park it for exact size reuse instead of merging
+    if ((umem_flags & UMEM_QUICK_BINS) && quick_free(ptr, header))
+    {
+        return;
+    }
+    validate_free_ptr(ptr, header);
+
+    // get the size of the block to free
+    size_t size_to_free = header->size;
+    update_free_stats(size_to_free);
+
+    // initialize a free block
+    node_t *free_block = init_free_block(header, size_to_free);
+    coalesce_block(free_block);
+}
+
+void coalesce_block(node_t *free_block)
+{
+    if (allocationAlgo == TLSF)
+    {
+        tlsf_release(free_block);
+        calculate_fragmentation();
+        return;
+    }
+
+    // if the free list is empty, add the block to the head
+    if (list_head == NULL)
+    {
+        list_head = free_block;
+        index_insert(free_block);
+        calculate_fragmentation();
+
+        return;
+    }
+
+    node_t *current = list_head;
+    node_t *prev = NULL;
+
+    // iterate through the free list
+    while (current != NULL)
+    {
+        // Check if we can merge with the previous block
+        if ((char *)current + current->size == (char *)free_block)
+        {
+            current->size += free_block->size;
+            index_update(current, current);
+
+            // Check if we can also merge with the next block
+            merge_with_next_blocks(current);
+            calculate_fragmentation();
+
+            return;
+        }
+
+        // Check if we can merge with the next block
+        if ((char *)free_block + free_block->size == (char *)current)
+        {
+            free_block->size += current->size;
+            list_link(free_block, list_next(current));
+            index_update(current, free_block);
+            if (last_allocation == current)
+            {
+                last_allocation = free_block;
+            }
+
+            if (prev == NULL)
+            {
+                list_head = free_block;
+            }
+            else
+            {
+                list_link(prev, free_block);
+            }
+
+            // After merging with next, check if we can merge with previous
+            if (prev != NULL && (char *)prev + prev->size == (char *)free_block)
+            {
+                index_remove(free_block);
+                prev->size += free_block->size;
+                list_link(prev, list_next(free_block));
+                index_update(prev, prev);
+                if (last_allocation == free_block)
+                {
+                    last_allocation = prev;
+                }
+            }
+
+            calculate_fragmentation();
+
+            return;
+        }
+
+        // Insert in address order if no merging is possible
+        if ((char *)free_block < (char *)current)
+        {
+            insert_block(free_block, current, prev);
+            index_insert(free_block);
+            calculate_fragmentation();
+
+            return;
+        }
+
+        prev = current;
+        current = list_next(current);
+    }
+
+    // Add to end if we get here
+    list_link(prev, free_block);
+    index_insert(free_block);
+    calculate_fragmentation();
+}
+
+void validate_realloc_ptr(void *ptr, header_t *header)
+{
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    validate_guard(ptr, header);
+#endif
+    // magic number check, a sampled block is just as live
+    if (header->magic != MAGIC && header->magic != PROF_MAGIC)
+    {
+        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
+        exit(1);
+    }
+}
+
+void shrink_block(header_t *current_header, size_t aligned_new_size, size_t old_size)
+{
+    if (allocationAlgo == TLSF)
+    {
+        tlsf_shrink(current_header, aligned_new_size, old_size);
+        return;
+    }
+
+    // get the new free block
+    node_t *new_free_block = (node_t *)((char *)current_header + aligned_new_size);
+    new_free_block->size = old_size - aligned_new_size;
+    list_link(new_free_block, NULL);
+    current_header->size = aligned_new_size;
+
+    // update stats
+    current_allocated -= new_free_block->size;
+    current_free += new_free_block->size;
+
+    // Add to free list in order
+    if (list_head == NULL || (char *)list_head > (char *)new_free_block)
+    {
+        list_link(new_free_block, list_head);
+        list_head = new_free_block;
+    }
+    else // insert in the middle
+    {
+        node_t *current = list_head;
+        while (list_next(current) != NULL &&
+               (char *)list_next(current) < (char *)new_free_block)
+        {
+            current = list_next(current);
+        }
+        list_link(new_free_block, list_next(current));
+        list_link(current, new_free_block);
+    }
+    index_insert(new_free_block);
+}
+
+static size_t expand_block(header_t *header, size_t min_size, size_t preferred_size)
+{
+    // grow into the free block right behind when that reaches min_size,
+    // then give back whatever lies past preferred_size; returns the size
+    // the block ends up with, the payload never moves
+    size_t old_size = header->size;
+    node_t *next = (node_t *)((char *)header + old_size);
+    if (old_size >= preferred_size || (char *)next >= region_start + region_size)
+    {
+        return old_size;
+    }
+
+    if (allocationAlgo == TLSF)
+    {
+        if (!tlsf_is_free(next) || old_size + next->size < min_size)
+        {
+            return old_size;
+        }
+        tlsf_remove(next);
+    }
+    else
+    {
+        // the list is in address order, so the neighbour is free only if
+        // the list has a block at exactly that address
+        node_t *prev = NULL;
+        node_t *current = list_head;
+        if (index_blocks != NULL)
+        {
+            int i = index_position(next);
+            prev = i > 0 ? index_blocks[i - 1] : NULL;
+            current = i < index_count ? index_blocks[i] : NULL;
+        }
+        else
+        {
+            while (current != NULL && current < next)
+            {
+                prev = current;
+                current = list_next(current);
+            }
+        }
+        if (current != next || old_size + next->size < min_size)
+        {
+            return old_size;
+        }
+
+        if (prev == NULL)
+        {
+            list_head = list_next(next);
+        }
+        else
+        {
+            list_link(prev, list_next(next));
+        }
+        index_remove(next);
+        if (last_allocation == next)
+        {
+            last_allocation = list_next(next) != NULL ? list_next(next) : list_head;
+        }
+    }
+
+    header->size += next->size;
+    current_allocated += next->size;
+    current_free -= next->size;
+
+    // shrink_block knows how small a tail each policy can list
+    if ((size_t)header->size >= preferred_size + sizeof(node_t))
+    {
+        shrink_block(header, preferred_size, header->size);
+    }
+    return header->size;
+}
+
+void *resize_block(void *ptr, size_t new_size);
+
+void *urealloc(void *ptr, size_t new_size)
+{
+    heap_lock_acquire();
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    // room for the tail canary, unless umalloc or ufree does all the work
+    void *new_ptr = resize_block(ptr, ptr != NULL && new_size != 0 ? new_size + sizeof(long) : new_size);
+    guard_set(new_ptr);
+#else
+    void *new_ptr = resize_block(ptr, new_size);
+#endif
+    metrics_publish(METRICS_SNAPSHOT, 0, 0);
+    heap_lock_release();
+    return new_ptr;
+}
+
+void *resize_block(void *ptr, size_t new_size)
+{
+    // if ptr is NULL, just allocate new block
+    if (ptr == NULL)
+    {
+        return umalloc(new_size);
+    }
+
+    // if new size is 0, free the block and return NULL
+    if (new_size == 0)
+    {
+        ufree(ptr);
+        return NULL;
+    }
+    // what the caller asked for, umalloc adds its own canary
+    size_t requested = new_size - GUARD_BYTES;
+
+    // a slot can't grow in place, move it if the new size doesn't fit
+    small_run_t *run = small_run_of(ptr);
+    if (run != NULL)
+    {
+        if (requested <= run->slot_size)
+        {
+            return ptr;
+        }
+        void *new_ptr = umalloc(requested);
+        if (new_ptr != NULL)
+        {
+            memcpy(new_ptr, ptr, run->slot_size);
+            ufree(ptr);
+        }
+        return new_ptr;
+    }
+    if (oob_entries != NULL)
+    {
+        return oob_resize(ptr, new_size);
+    }
+
+    // get the header for the current block
+    header_t *current_header = (header_t *)((char *)ptr - sizeof(header_t));
+
+    validate_realloc_ptr(ptr, current_header); // validate the pointer
+
+    size_t old_size = current_header->size;
+<<<<<<< HEAD
+    size_t aligned_new_size = ((new_size + sizeof(header_t) + 7) / 8) * 8; // 8 byte alignment
+
+    // if the new size is smaller or equal, we can shrink or just return the pointer
+    if (aligned_new_size <= old_size)
+    {
+        // shrinking the block
+        if (aligned_new_size + sizeof(node_t) <= old_size)
+        {
+            shrink_block(current_header, aligned_new_size, old_size); // shrink the block
+=======
+    // size_t aligned_new_size = ((new_size + sizeof(header_t) + 7) / 8) * 8; // 8 byte alignment
+    size_t required_size = new_size + sizeof(header_t);
+
+    // if the new size is smaller or equal, we can shrink or just return the pointer
+    if (required_size <= old_size)
+    {
+        // shrinking the block
+        if (required_size + sizeof(node_t) <= old_size)
+        {
+            shrink_block(current_header, required_size, old_size); // shrink the block
+>>>>>>> afbf9b4... umalloc final
+        }
+        return ptr;
+    }
+
+    // take the free block behind if it is big enough, nothing to copy then
+    size_t grown_size = ((new_size + sizeof(header_t) + 7) / 8) * 8;
+    if (expand_block(current_header, grown_size, grown_size) >= grown_size)
+    {
+        return ptr;
+    }
+
+    // save the data before freeing
+    char saved_data[old_size - sizeof(header_t)];
+    char *old_data = (char *)ptr;
+    for (size_t i = 0; i < old_size - sizeof(header_t); i++)
+    {
+        saved_data[i] = old_data[i];
+    }
+
+    // free the old block first
+    ufree(ptr);
+
+    // allocate new block
+    void *new_ptr = umalloc(requested);
+    if (new_ptr == NULL)
+    {
+        // allocation failed - need to restore old state
+        // need to reallocate the old block
+        void *restored_ptr = umalloc(old_size - sizeof(header_t) - GUARD_BYTES);
+        if (restored_ptr != NULL)
+        {
+            char *restore_data = (char *)restored_ptr;
+            for (size_t i = 0; i < old_size - sizeof(header_t); i++)
+            {
+                restore_data[i] = saved_data[i]; // restore the data
+            }
+        }
+        return restored_ptr;
+    }
+
+    // copy saved data to new block
+    char *new_data = (char *)new_ptr;
+    for (size_t i = 0; i < old_size - sizeof(header_t); i++)
+    {
+        new_data[i] = saved_data[i]; // copy the data
+    }
+
+    return new_ptr;
+}
+
+size_t umem_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+    heap_lock_acquire();
+    size_t usable;
+    small_run_t *run = small_run_of(ptr);
+    if (oob_entries != NULL)
+    {
+        usable = oob_usable(ptr);
+    }
+    else if (run != NULL)
+    {
+        usable = run->slot_size;
+    }
+    else
+    {
+        header_t *header = (header_t *)((char *)ptr - sizeof(header_t));
+        validate_realloc_ptr(ptr, header);
+        usable = header->size - sizeof(header_t);
+    }
+    heap_lock_release();
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    // slots have no canary, every other block ends in one
+    if (run == NULL)
+    {
+        usable -= sizeof(long);
+    }
+#endif
+    return usable;
+}
+
+size_t umem_try_expand(void *ptr, size_t min_size, size_t preferred_size)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+    if (preferred_size < min_size)
+    {
+        preferred_size = min_size;
+    }
+
+    // a slot can't grow, it can only turn out to be big enough already
+    small_run_t *run = small_run_of(ptr);
+    if (run != NULL)
+    {
+        return min_size <= run->slot_size ? run->slot_size : 0;
+    }
+
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    // the canary moves out to the new end
+    min_size += sizeof(long);
+    preferred_size += sizeof(long);
+#endif
+    heap_lock_acquire();
+    size_t usable;
+    if (oob_entries != NULL)
+    {
+        usable = oob_expand(ptr, min_size, preferred_size);
+    }
+    else
+    {
+        header_t *header = (header_t *)((char *)ptr - sizeof(header_t));
+        validate_realloc_ptr(ptr, header);
+        size_t min_block = ((min_size + sizeof(header_t) + 7) / 8) * 8;
+        size_t preferred_block = ((preferred_size + sizeof(header_t) + 7) / 8) * 8;
+        size_t block_size = expand_block(header, min_block, preferred_block);
+        usable = block_size >= min_block ? block_size - sizeof(header_t) : 0;
+    }
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    if (usable != 0)
+    {
+        guard_set(ptr);
+        usable -= sizeof(long);
+    }
+#endif
+    heap_lock_release();
+    return usable;
+}
+
+void ufree_sized(void *ptr, size_t size)
+{
+    // the size lives next to the magic number ufree reads anyway, so the
+    // caller's size buys no lookup; hardened builds use it to catch
+    // mismatched frees, the rest go straight to ufree
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    if (ptr != NULL && size > umem_usable_size(ptr))
+    {
+        fprintf(stderr, "Error: Sized free of %zu bytes does not match block %p\n", size, ptr);
+        exit(1);
+    }
+#else
+    (void)size;
+#endif
+    ufree(ptr);
+}
+
+void *aligned_block(size_t alignment, size_t size);
+
+void *umemalign(size_t alignment, size_t size)
+{
+    // every block is already 8 byte aligned; umalloc adds the canary and
+    // takes the sample itself
+    if (alignment <= 8)
+    {
+        return umalloc(size);
+    }
+
+    heap_lock_acquire();
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    void *ptr = aligned_block(alignment, size != 0 ? size + sizeof(long) : 0);
+    guard_set(ptr);
+#else
+    void *ptr = aligned_block(alignment, size);
+#endif
+    prof_note_alloc(ptr, size);
+    metrics_publish(METRICS_SNAPSHOT, 0, 0);
+    heap_lock_release();
+    return ptr;
+}
+
+void *aligned_block(size_t alignment, size_t size)
+{
+    // every block is already 8 byte aligned
+    if (alignment <= 8)
+    {
+        return umalloc(size);
+    }
+    if ((alignment & (alignment - 1)) != 0)
+    {
+        return NULL;
+    }
+    if (oob_entries != NULL)
+    {
+        return oob_aligned(alignment, size);
+    }
+
+    // over-allocate so an aligned payload fits with room for a free node in front
+    size_t aligned_size = ((size + 7) / 8) * 8;
+    // TLSF can't list a free block too small for its links and footer
+    size_t min_gap = allocationAlgo == TLSF ? MIN_BLOCK_SIZE : sizeof(node_t);
+    char *raw = fit_alloc(aligned_size + alignment + min_gap);
+    if (raw == NULL)
+    {
+        return NULL;
+    }
+
+    header_t *raw_header = (header_t *)(raw - sizeof(header_t));
+    char *payload = (char *)(((unsigned long)raw + alignment - 1) & ~(unsigned long)(alignment - 1));
+    if (payload != raw && (size_t)(payload - raw) < min_gap)
+    {
+        payload += alignment; // gap too small to hold a free block
+    }
+    if (payload == raw)
+    {
+        return raw;
     }
 
-    // set threshold for small blocks
-    size_t small_block_def = largest_free / 2;
-    current = list_head;
+    // the aligned block takes over the tail of the raw block
+    size_t gap = payload - raw;
+    header_t *aligned_header = (header_t *)(payload - sizeof(header_t));
+    aligned_header->size = raw_header->size - gap;
+    aligned_header->magic = MAGIC;
 
-    // calculate fragmentation
-    while (current != NULL)
+    // hand the leading gap back to the free list
+    current_allocated -= gap;
+    current_free += gap;
+    coalesce_block(init_free_block(raw_header, gap));
+
+    // and whatever is left over behind the payload
+    if ((size_t)aligned_header->size >= aligned_size + sizeof(header_t) + sizeof(node_t))
     {
-        if (current->size < small_block_def)
-        {
-            mem_in_small_blocks += current->size;
-        }
-        current = current->next;
+        shrink_block(aligned_header, aligned_size + sizeof(header_t), aligned_header->size);
     }
-
-    fragmentation = ((float)mem_in_small_blocks / (float)current_free) * 100.0;
-    return fragmentation;
+    return payload;
 }
 
-void validate_free_ptr(void *ptr, header_t *header)
+umem_handle_t umem_halloc(size_t size)
 {
-    if (header->magic != MAGIC)
+    heap_lock_acquire();
+
+    // find an unused slot first so a full table doesn't leak the block
+    umem_handle_t handle = 0;
+    while (handle < MAX_HANDLES && handles[handle].ptr != NULL)
     {
-        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
-        exit(1);
+        handle++;
     }
-    node_t *check = list_head;
-    while (check != NULL)
+
+    // straight from the fit policy: compaction needs a header_t to move
+#if UMEM_CHECK_LEVEL >= UMEM_CHECK_HARDENED
+    void *ptr = handle < MAX_HANDLES ? fit_alloc(size != 0 ? size + sizeof(long) : 0) : NULL;
+    guard_set(ptr);
+#else
+    void *ptr = handle < MAX_HANDLES ? fit_alloc(size) : NULL;
+#endif
+    if (ptr == NULL)
     {
-        if ((void *)check == (void *)header)
-        {
-            fprintf(stderr, "Error: Double free detected at block %p\n", ptr);
-            exit(1);
-        }
-        check = check->next;
+        handle = -1;
+    }
+    else
+    {
+        handles[handle].ptr = ptr;
+        handles[handle].pins = 0;
     }
-}
 
-void update_free_stats(size_t size_to_free)
-{
-    current_free += size_to_free;
-    // current_allocated -= size_to_free;
-    current_allocated -= (size_to_free - sizeof(header_t)); // update with "actual" bytes returned to user
-    num_deallocs += 1;
+    heap_lock_release();
+    return handle;
 }
 
-void merge_with_next_blocks(node_t *current)
+void *umem_hlock(umem_handle_t handle)
 {
-    // iterate through the free list and merge with the next block if possible
-    while (current->next != NULL &&
-           (char *)current + current->size == (char *)current->next)
+    void *ptr = NULL;
+    heap_lock_acquire();
+    if (handle >= 0 && handle < MAX_HANDLES && handles[handle].ptr != NULL)
     {
-        current->size += current->next->size; // merge the two blocks
-        current->next = current->next->next;  // set the next pointer to the next next block
+        handles[handle].pins++;
+        ptr = handles[handle].ptr;
     }
+    heap_lock_release();
+    return ptr;
 }
 
-void insert_block(node_t *free_block, node_t *current, node_t *prev)
+void umem_hunlock(umem_handle_t handle)
 {
-    // insert the block in the free list in address order
-    if (prev == NULL)
+    heap_lock_acquire();
+    if (handle >= 0 && handle < MAX_HANDLES && handles[handle].pins > 0)
     {
-        free_block->next = list_head;
-        list_head = free_block;
+        handles[handle].pins--;
     }
-    else // insert in the middle
+    heap_lock_release();
+}
+
+void umem_hfree(umem_handle_t handle)
+{
+    heap_lock_acquire();
+    if (handle >= 0 && handle < MAX_HANDLES && handles[handle].ptr != NULL)
     {
-        prev->next = free_block;
-        free_block->next = current;
+        free_block(handles[handle].ptr);
+        handles[handle].ptr = NULL;
+        handles[handle].pins = 0;
     }
+    heap_lock_release();
 }
 
-node_t *init_free_block(header_t *header, size_t size)
+static int compare_handles(const void *a, const void *b)
 {
-    // initialize a free block
-    node_t *free_block = (node_t *)header;
-    free_block->size = size;
-    free_block->next = NULL;
-    return free_block;
+    char *ptr_a = handles[*(const int *)a].ptr;
+    char *ptr_b = handles[*(const int *)b].ptr;
+    return (ptr_a > ptr_b) - (ptr_a < ptr_b);
 }
 
-void ufree(void *ptr)
+size_t umem_compact()
 {
-    // if ptr is NULL, return
-    if (ptr == NULL)
-        return;
-
-    // get the header for the current block
-    header_t *header = (header_t *)((char *)ptr - sizeof(header_t));
-    validate_free_ptr(ptr, header);
+    heap_lock_acquire();
+    remote_drain();
 
-    // check if the block is already in the free list
-    node_t *check = list_head;
-    while (check != NULL)
+    // every free block has to be on the list for the walk below
+    if (quick_bytes != 0)
     {
-        if ((void *)check == (void *)header)
-        {
-            fprintf(stderr, "Error: Double free detected at block %p\n", ptr);
-            exit(1);
-        }
-        check = check->next;
+        umem_consolidate();
     }
 
-    // get the size of the block to free
-    size_t size_to_free = header->size;
-    update_free_stats(size_to_free);
-
-    // initialize a free block
-    node_t *free_block = init_free_block(header, size_to_free);
-
-    // if the free list is empty, add the block to the head
-    if (list_head == NULL)
+    // table heaps don't move blocks, report what is there
+    if (oob_entries != NULL)
     {
-        list_head = free_block;
-        calculate_fragmentation();
-
-        return;
+        size_t largest = oob_largest();
+        heap_lock_release();
+        return largest;
     }
 
-    node_t *current = list_head;
-    node_t *prev = NULL;
-
-    // iterate through the free list
-    while (current != NULL)
+    // live handles in address order, to match them up during the walk
+    static int order[MAX_HANDLES];
+    int live = 0;
+    for (int i = 0; i < MAX_HANDLES; i++)
     {
-        // Check if we can merge with the previous block
-        if ((char *)current + current->size == (char *)free_block)
+        if (handles[i].ptr != NULL)
         {
-            current->size += free_block->size;
+            order[live++] = i;
+        }
+    }
+    qsort(order, live, sizeof(int), compare_handles);
 
-            // Check if we can also merge with the next block
-            merge_with_next_blocks(current);
-            calculate_fragmentation();
+    // walk the region block by block: the free list tells free blocks apart,
+    // unpinned handle blocks slide down to dest, anything else stays put and
+    // closes the gap in front of it
+    char *region_end = region_start + region_size;
+    char *pos = region_start;
+    char *dest = NULL; // start of the gap being filled, NULL if none
+    node_t *free_cursor = list_head;
+    node_t *new_head = NULL;
+    node_t *new_tail = NULL;
+    int h = 0;
+    size_t largest = 0;
 
-            return;
+    while (pos < region_end)
+    {
+        bool tlsf_free = allocationAlgo == TLSF && tlsf_is_free(pos);
+        if (tlsf_free || (node_t *)pos == free_cursor)
+        {
+            size_t size = ((node_t *)pos)->size;
+            if (!tlsf_free)
+            {
+                free_cursor = list_next(free_cursor);
+            }
+            if (dest == NULL)
+            {
+                dest = pos;
+            }
+            pos += size;
+            continue;
         }
 
-        // Check if we can merge with the next block
-        if ((char *)free_block + free_block->size == (char *)current)
+        size_t size = ((header_t *)pos)->size;
+        int movable = 0;
+        if (h < live && handles[order[h]].ptr == pos + sizeof(header_t))
         {
-            free_block->size += current->size;
-            free_block->next = current->next;
+            movable = handles[order[h]].pins == 0;
+            if (movable && dest != NULL)
+            {
+                memmove(dest, pos, size);
+                handles[order[h]].ptr = dest + sizeof(header_t);
+                dest += size;
+            }
+            h++;
+        }
 
-            if (prev == NULL)
+        if (!movable && dest != NULL)
+        {
+            // the gap ends at a block that can't move
+            node_t *gap = init_free_block((header_t *)dest, pos - dest);
+            if (new_tail != NULL)
             {
-                list_head = free_block;
+                list_link(new_tail, gap);
             }
             else
             {
-                prev->next = free_block;
+                new_head = gap;
             }
-
-            // After merging with next, check if we can merge with previous
-            if (prev != NULL && (char *)prev + prev->size == (char *)free_block)
+            new_tail = gap;
+            if ((size_t)gap->size > largest)
             {
-                prev->size += free_block->size;
-                prev->next = free_block->next;
+                largest = gap->size;
             }
-
-            calculate_fragmentation();
-
-            return;
+            dest = NULL;
         }
+        pos += size;
+    }
 
-        // Insert in address order if no merging is possible
-        if ((char *)free_block < (char *)current)
+    if (dest != NULL)
+    {
+        node_t *gap = init_free_block((header_t *)dest, region_end - dest);
+        if (new_tail != NULL)
         {
-            insert_block(free_block, current, prev);
-            calculate_fragmentation();
-
-            return;
+            list_link(new_tail, gap);
+        }
+        else
+        {
+            new_head = gap;
+        }
+        if ((size_t)gap->size > largest)
+        {
+            largest = gap->size;
         }
-
-        prev = current;
-        current = current->next;
     }
 
-    // Add to end if we get here
-    prev->next = free_block;
-    calculate_fragmentation();
-}
-
-void validate_realloc_ptr(void *ptr, header_t *header)
-{
-    // magic number check
-    if (header->magic != MAGIC)
+    // old free nodes are gone, everything that pointed at them starts over
+    list_head = new_head;
+    last_allocation = NULL;
+    index_rebuild();
+    if (allocationAlgo == TLSF)
     {
-        fprintf(stderr, "Error: Memory corruption detected at block %p\n", ptr);
-        exit(1);
+        tlsf_adopt_list();
     }
+    if (new_head != NULL)
+    {
+        calculate_fragmentation();
+    }
+    heap_lock_release();
+    return largest;
 }
 
-void shrink_block(header_t *current_header, size_t aligned_new_size, size_t old_size)
+int umem_walk(umem_walk_fn callback, void *arg)
 {
-    // get the new free block
-    node_t *new_free_block = (node_t *)((char *)current_header + aligned_new_size);
-    new_free_block->size = old_size - aligned_new_size;
-    new_free_block->next = NULL;
-    current_header->size = aligned_new_size;
-
-    // update stats
-    current_allocated -= new_free_block->size;
-    current_free += new_free_block->size;
-
-    // Add to free list in order
-    if (list_head == NULL || (char *)list_head > (char *)new_free_block)
+    heap_lock_acquire();
+    remote_drain();
+    if (oob_entries != NULL)
     {
-        new_free_block->next = list_head;
-        list_head = new_free_block;
+        int blocks = oob_walk(callback, arg);
+        heap_lock_release();
+        return blocks;
     }
-    else // insert in the middle
+
+    // same walk as umem_compact: the free list, in address order, tells the
+    // free blocks apart, everything else starts with a header_t
+    char *region_end = region_start + region_size;
+    char *pos = region_start;
+    node_t *free_cursor = list_head;
+    int blocks = 0;
+
+    while (pos < region_end)
     {
-        node_t *current = list_head;
-        while (current->next != NULL &&
-               (char *)current->next < (char *)new_free_block)
+        size_t size;
+        int state;
+        if (allocationAlgo == TLSF && tlsf_is_free(pos))
+        {
+            size = ((node_t *)pos)->size;
+            state = UMEM_BLOCK_FREE;
+        }
+        else if ((node_t *)pos == free_cursor)
+        {
+            size = free_cursor->size;
+            state = UMEM_BLOCK_FREE;
+            free_cursor = list_next(free_cursor);
+        }
+        else
+        {
+            header_t *block = (header_t *)pos;
+            size = block->size;
+            if (block->magic == QUICK_MAGIC || block->magic == PCPU_MAGIC)
+            {
+                state = UMEM_BLOCK_PARKED;
+            }
+            else if (span_of(pos + sizeof(header_t)) != NULL)
+            {
+                state = span_of(pos + sizeof(header_t))->state == SPAN_RUN ? UMEM_BLOCK_RUN : UMEM_BLOCK_PARKED;
+            }
+            else
+            {
+                state = UMEM_BLOCK_USED;
+            }
+        }
+
+        if (size < sizeof(header_t) || size > (size_t)(region_end - pos))
         {
-            current = current->next;
+            fprintf(stderr, "Error: Heap walk stopped at damaged block %p\n", pos);
+            heap_lock_release();
+            return -1;
         }
-        new_free_block->next = current->next;
-        current->next = new_free_block;
+        callback(pos, size, state, arg);
+        blocks++;
+        pos += size;
     }
+
+    heap_lock_release();
+    return blocks;
 }
 
-void *urealloc(void *ptr, size_t new_size)
+// heap map state, filled one cell at a time as the walk goes by
+typedef struct
 {
-    // if ptr is NULL, just allocate new block
-    if (ptr == NULL)
+    FILE *out;
+    size_t granularity;
+    int format;
+    size_t cell_start; // region offset of the cell being filled
+    size_t used;
+    size_t free;
+    int blocks; // blocks starting in the cell
+} heap_map_t;
+
+static void map_emit(heap_map_t *map)
+{
+    if (map->format == UMEM_MAP_BINARY)
     {
-        return umalloc(new_size);
+        size_t total = map->used + map->free;
+        fputc((int)(map->used * 255 / total), map->out);
     }
-
-    // if new size is 0, free the block and return NULL
-    if (new_size == 0)
+    else
     {
-        ufree(ptr);
-        return NULL;
+        fprintf(map->out, "%zu,%zu,%zu,%d\n", map->cell_start, map->used, map->free, map->blocks);
     }
+    map->cell_start += map->granularity;
+    map->used = 0;
+    map->free = 0;
+    map->blocks = 0;
+}
 
-    // get the header for the current block
-    header_t *current_header = (header_t *)((char *)ptr - sizeof(header_t));
-
-    validate_realloc_ptr(ptr, current_header); // validate the pointer
-
-    size_t old_size = current_header->size;
-<<<<<<< HEAD
-    size_t aligned_new_size = ((new_size + sizeof(header_t) + 7) / 8) * 8; // 8 byte alignment
+static void map_block(void *block, size_t size, int state, void *arg)
+{
+    heap_map_t *map = arg;
+    bool used = state == UMEM_BLOCK_USED || state == UMEM_BLOCK_RUN || state == UMEM_BLOCK_META;
+    size_t offset = (char *)block - region_start;
+    map->blocks++;
 
-    // if the new size is smaller or equal, we can shrink or just return the pointer
-    if (aligned_new_size <= old_size)
+    // spread the block over every cell it touches
+    while (size > 0)
     {
-        // shrinking the block
-        if (aligned_new_size + sizeof(node_t) <= old_size)
+        size_t cell_end = map->cell_start + map->granularity;
+        size_t take = size < cell_end - offset ? size : cell_end - offset;
+        if (used)
         {
-            shrink_block(current_header, aligned_new_size, old_size); // shrink the block
-=======
-    // size_t aligned_new_size = ((new_size + sizeof(header_t) + 7) / 8) * 8; // 8 byte alignment
-    size_t required_size = new_size + sizeof(header_t);
-
-    // if the new size is smaller or equal, we can shrink or just return the pointer
-    if (required_size <= old_size)
-    {
-        // shrinking the block
-        if (required_size + sizeof(node_t) <= old_size)
+            map->used += take;
+        }
+        else
         {
-            shrink_block(current_header, required_size, old_size); // shrink the block
->>>>>>> afbf9b4... umalloc final
+            map->free += take;
+        }
+        offset += take;
+        size -= take;
+        if (offset == cell_end)
+        {
+            map_emit(map);
         }
-        return ptr;
     }
+}
 
-    // save the data before freeing
-    char saved_data[old_size - sizeof(header_t)];
-    char *old_data = (char *)ptr;
-    for (size_t i = 0; i < old_size - sizeof(header_t); i++)
+int umem_heap_map(FILE *out, size_t granularity, int format)
+{
+    if (granularity == 0)
     {
-        saved_data[i] = old_data[i];
+        return -1;
     }
 
-    // free the old block first
-    ufree(ptr);
-
-    // allocate new block
-    void *new_ptr = umalloc(new_size);
-    if (new_ptr == NULL)
+    heap_map_t map = {out, granularity, format, 0, 0, 0, 0};
+    if (format == UMEM_MAP_CSV)
     {
-        // allocation failed - need to restore old state
-        // need to reallocate the old block
-        void *restored_ptr = umalloc(old_size - sizeof(header_t));
-        if (restored_ptr != NULL)
-        {
-            char *restore_data = (char *)restored_ptr;
-            for (size_t i = 0; i < old_size - sizeof(header_t); i++)
-            {
-                restore_data[i] = saved_data[i]; // restore the data
-            }
-        }
-        return restored_ptr;
+        fprintf(out, "offset,used,free,blocks\n");
     }
+    int blocks = umem_walk(map_block, &map);
 
-    // copy saved data to new block
-    char *new_data = (char *)new_ptr;
-    for (size_t i = 0; i < old_size - sizeof(header_t); i++)
+    // a region that doesn't divide evenly ends in a short cell
+    if (blocks >= 0 && map.used + map.free != 0)
     {
-        new_data[i] = saved_data[i]; // copy the data
+        map_emit(&map);
     }
-
-    return new_ptr;
+    return blocks;
 }
 
 // reset memory allocation stats
 void reset_values()
 {
+    background_stop(); // before the heap it works on goes away
     num_allocs = 0;
     num_deallocs = 0;
     current_allocated = 0;
@@ -680,4 +5274,33 @@ void reset_values()
     fragmentation = 0.0;
     list_head = NULL;
     last_allocation = NULL;
+    hot_cursor = NULL;
+    heap_buffer = false;
+    index_release();
+    small_release();
+    tlsf_release_map();
+    pcpu_release();
+    oob_entries = NULL;
+    oob_base = NULL;
+    oob_granules = 0;
+    oob_head = OOB_NIL;
+    oob_singles = OOB_NIL;
+    for (size_t i = 0; i <= QUICK_MAX_BLOCK / 8; i++)
+    {
+        quick_bins[i] = NULL;
+    }
+    quick_bytes = 0;
+    remote_frees = NULL;
+    search_steps = 0;
+    adapt_allocs = 0;
+    adapt_failures = 0;
+    adapt_steps_start = 0;
+    adapt_candidate = 0;
+    adapt_votes = 0;
+    for (int i = 0; i < MAX_HANDLES; i++)
+    {
+        handles[i].ptr = NULL;
+        handles[i].pins = 0;
+    }
+    prof_clear_live();
 }
\ No newline at end of file
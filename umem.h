@@ -4,6 +4,11 @@
 #include <stddef.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 #define MAGIC 0xDEADBEEFLL // Magic number used for detecting memory corruption
 
 #define BEST_FIT (1)
@@ -11,6 +16,35 @@
 #define FIRST_FIT (3)
 #define NEXT_FIT (4)
 #define BUDDY (5)
+#define TLSF (6) // two-level segregated fit, constant time umalloc and ufree
+
+// mode flags, or'd into the algorithm passed to umeminit
+#define UMEM_ALGO_MASK (0xff)
+#define UMEM_SIZE_INDEX (1 << 8) // mirror free block sizes in a packed array for fit searches
+#define UMEM_SMALL_BITMAP (1 << 9) // serve requests up to 256 bytes from headerless bitmap runs
+#define UMEM_QUICK_BINS (1 << 10)  // park freed blocks by size and merge them lazily
+#define UMEM_ADAPTIVE (1 << 11)    // switch fit policy at runtime from fragmentation and search cost
+#define UMEM_THREADED (1 << 12)    // lock the heap; frees from other threads go through a lock-free queue
+#define UMEM_SIZE_CLASSES (1 << 13) // bitmap runs with classes learned from the request sizes
+#define UMEM_PERCPU (1 << 14)       // per-CPU caches of small blocks in front of the heap, implies UMEM_THREADED; ignored with the bitmap runs
+#define UMEM_BACKGROUND (1 << 15)   // ufree only queues, a maintenance thread merges and trims; implies UMEM_THREADED
+#define UMEM_OUT_OF_BAND (1 << 16)  // block sizes and free links in a table at the front of the region, no headers
+#define UMEM_THREAD_SPANS (1 << 17) // small blocks from runs owned by one thread each, no cache line shared; implies UMEM_SMALL_BITMAP and UMEM_THREADED
+
+// placement hints for umalloc_hint, on the list policies
+#define UMEM_SHORT_LIVED (1 << 0) // placed by the policy as usual, at the bottom of the region
+#define UMEM_LONG_LIVED (1 << 1)  // cut from the top of the region, away from the churn
+#define UMEM_HOT (1 << 2)         // at the bottom, right after the previous hot block when there is room
+#define UMEM_COLD (1 << 3)        // out of the way at the top, like UMEM_LONG_LIVED
+
+// checking level, chosen at build time with -DUMEM_CHECK_LEVEL=...
+#define UMEM_CHECK_FAST (0)     // header magic only
+#define UMEM_CHECK_DEFAULT (1)  // plus double free detection
+#define UMEM_CHECK_HARDENED (2) // plus tail canaries, bounds checks and poisoned frees
+
+#ifndef UMEM_CHECK_LEVEL
+#define UMEM_CHECK_LEVEL UMEM_CHECK_DEFAULT
+#endif
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // structures : Both structures are required and are 64 bit.
@@ -28,14 +62,118 @@ typedef struct __node_t
     struct __node_t *next; // Pointer to the next free block
 } node_t;
 
+typedef int umem_handle_t; // index into the movable allocation table, -1 on failure
+
+// block states reported by umem_walk
+#define UMEM_BLOCK_FREE (0)   // on the free list
+#define UMEM_BLOCK_USED (1)   // handed out
+#define UMEM_BLOCK_PARKED (2) // freed but waiting in a quick bin
+#define UMEM_BLOCK_RUN (3)    // window cut into bitmap slots
+#define UMEM_BLOCK_META (4)   // the UMEM_OUT_OF_BAND block table
+
+// heap map formats
+#define UMEM_MAP_CSV (0)    // offset,used,free,blocks per cell
+#define UMEM_MAP_BINARY (1) // one byte per cell, 0 all free to 255 all in use
+
+typedef void (*umem_walk_fn)(void *block, size_t size, int state, void *arg);
+
+// live metrics page, see umem_metrics_export. the histograms count calls
+// by log2: bucket i holds values from 2^i up to 2^(i+1), the last one
+// everything above
+#define UMEM_METRICS_MAGIC 0x554D454D4D455452LL // "UMEMMETR"
+#define UMEM_METRICS_VERSION (1)
+#define UMEM_METRICS_BUCKETS (32)
+
+typedef struct
+{
+    long magic;
+    long version;
+    long pid;
+    unsigned long seq; // odd while the allocator is writing the page
+    long num_allocs;
+    long num_deallocs;
+    unsigned long current_allocated;
+    unsigned long current_free;
+    float fragmentation;
+    long search_steps;                                 // free blocks inspected by the fit searches so far
+    unsigned long search_lengths[UMEM_METRICS_BUCKETS]; // per call, in blocks inspected
+    unsigned long alloc_latency[UMEM_METRICS_BUCKETS];  // umalloc, in nanoseconds
+    unsigned long free_latency[UMEM_METRICS_BUCKETS];   // ufree, in nanoseconds
+} umem_metrics_t;
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // function prototypes
 //
 int umeminit(size_t sizeOfRegion, int allocationAlgo);
 void *umalloc(size_t size);
+void *umalloc_hint(size_t size, int hints); // umalloc with UMEM_SHORT_LIVED, UMEM_LONG_LIVED, UMEM_HOT or UMEM_COLD placement
 void *urealloc(void *ptr, size_t size);
 void ufree(void *ptr);
+void ufree_sized(void *ptr, size_t size);
+size_t umem_usable_size(void *ptr); // bytes the block really holds, at least what was asked for
+size_t umem_try_expand(void *ptr, size_t min_size, size_t preferred_size); // grow in place toward preferred_size, 0 if min_size can't be had without moving
+void *umemalign(size_t alignment, size_t size);
 void umemstats(void);
+void umem_consolidate(void);
+int umem_policy(void); // fit policy in use right now, changes under UMEM_ADAPTIVE
+void umem_claim_heap(void); // make the calling thread the owner under UMEM_THREADED
+void umem_class_report(FILE *out); // recent small request sizes, their slots and the waste
+void umem_cache_flush(void); // hand cached blocks back to the heap; with rseq only the calling CPU's
+
+// movable allocations: lock to get the current address, unlock so
+// umem_compact may move the block; umem_compact returns the largest free block
+umem_handle_t umem_halloc(size_t size);
+void *umem_hlock(umem_handle_t handle);
+void umem_hunlock(umem_handle_t handle);
+void umem_hfree(umem_handle_t handle);
+size_t umem_compact(void);
+
+// visit every block in address order with its header included in the size;
+// the heap is locked meanwhile, so the callback must not call back into it.
+// the map splits the region into granularity byte cells for plotting
+int umem_walk(umem_walk_fn callback, void *arg);
+int umem_heap_map(FILE *out, size_t granularity, int format);
+
+// heap on memory the caller already owns, a stack array, static storage or
+// a slice of another mapping: no syscalls unless a mode needs a side table.
+// umem_close forgets the heap and leaves the memory alone, after which a
+// new heap can be set up
+int umeminit_buffer(void *buf, size_t len, int allocationAlgo);
+
+// persistent heap in a file: reopening a file that was closed with
+// umem_close brings back the free list, stats and root as they were, a
+// file left open by a crash is rebuilt by scanning its blocks. the root
+// also works for shared heaps
+int umeminit_file(const char *path, size_t sizeOfRegion, int allocationAlgo);
+int umem_close(void);
+void umem_set_root(void *ptr);
+void *umem_get_root(void);
+
+// heap in a named shared memory object: the first process creates it, the
+// rest attach wherever the mapping lands and share it under a process-shared lock.
+// pass blocks between processes as offsets; umem_close detaches, shm_unlink
+// removes the object
+int umeminit_shared(const char *name, size_t sizeOfRegion, int allocationAlgo);
+long umem_offset(void *ptr);
+void *umem_pointer(long offset);
+
+// sampled heap profiling: one stack trace roughly every sample_bytes
+// allocated (0 turns it off), dumped in legacy pprof heap format
+void umem_prof_set_rate(size_t sample_bytes);
+void umem_prof_dump(FILE *out);
+
+// live metrics in a named shared memory object, rewritten by every umalloc
+// and ufree that takes the heap lock and by umalloc_hint, urealloc and
+// umemalign; per-CPU cache hits show up in the counts with the next
+// write. NULL stops publishing, shm_unlink
+// removes the object. an agent maps the object read-only and copies it
+// out with umem_metrics_read, which retries around writes in flight
+int umem_metrics_export(const char *name);
+int umem_metrics_read(const umem_metrics_t *page, umem_metrics_t *out);
+
+#ifdef __cplusplus
+}
+#endif
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 /**
@@ -0,0 +1,105 @@
+#ifndef _UMEM_HPP
+#define _UMEM_HPP
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+#include "umem.h"
+
+namespace umem
+{
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // allocator : standard Allocator over the umem heap. Stateless, so any two
+    //             instances compare equal and containers can swap freely.
+    //             It adds no locking: containers used from more than one
+    //             thread need a heap set up with UMEM_THREADED.
+    //
+    template <class T>
+    struct allocator
+    {
+        using value_type = T;
+
+        allocator() noexcept = default;
+
+        template <class U>
+        allocator(const allocator<U> &) noexcept {}
+
+        T *allocate(std::size_t n)
+        {
+            if (n > static_cast<std::size_t>(-1) / sizeof(T))
+            {
+                throw std::bad_array_new_length();
+            }
+
+            // umalloc returns NULL for 0 bytes, containers expect a pointer
+            std::size_t bytes = n != 0 ? n * sizeof(T) : 1;
+            void *ptr = alignof(T) > 8 ? umemalign(alignof(T), bytes) : umalloc(bytes);
+            if (ptr == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+            return static_cast<T *>(ptr);
+        }
+
+        void deallocate(T *ptr, std::size_t n) noexcept
+        {
+            ufree_sized(ptr, n * sizeof(T));
+        }
+    };
+
+    template <class T, class U>
+    bool operator==(const allocator<T> &, const allocator<U> &) noexcept
+    {
+        return true;
+    }
+
+    template <class T, class U>
+    bool operator!=(const allocator<T> &, const allocator<U> &) noexcept
+    {
+        return false;
+    }
+
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // memory_resource : std::pmr adapter so pmr containers can sit on the
+    //                   umem heap. The second constructor sets the heap up
+    //                   with the given size and policy if nobody has yet,
+    //                   always with UMEM_THREADED since pmr resources are
+    //                   routinely shared between threads.
+    //
+    class memory_resource : public std::pmr::memory_resource
+    {
+    public:
+        memory_resource() noexcept = default;
+
+        memory_resource(std::size_t region_size, int algo)
+        {
+            umeminit(region_size, algo | UMEM_THREADED);
+        }
+
+    protected:
+        void *do_allocate(std::size_t bytes, std::size_t alignment) override
+        {
+            void *ptr = umemalign(alignment, bytes != 0 ? bytes : 1);
+            if (ptr == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+            return ptr;
+        }
+
+        void do_deallocate(void *ptr, std::size_t bytes, std::size_t) override
+        {
+            ufree_sized(ptr, bytes);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+        {
+            // there is only one umem heap, so every umem resource can free
+            // what another one allocated
+            return dynamic_cast<const memory_resource *>(&other) != nullptr;
+        }
+    };
+}
+
+#endif
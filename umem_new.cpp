@@ -0,0 +1,195 @@
+// Link this file into a program to route every global operator new/delete
+// through the umem heap. The heap is set up on first use; override the size
+// and policy with -DUMEM_NEW_REGION_SIZE=... and -DUMEM_NEW_ALGO=...
+
+#include <cstddef>
+#include <new>
+
+#include "umem.h"
+
+#ifndef UMEM_NEW_REGION_SIZE
+#define UMEM_NEW_REGION_SIZE (64UL * 1024 * 1024)
+#endif
+
+#ifndef UMEM_NEW_ALGO
+#define UMEM_NEW_ALGO FIRST_FIT
+#endif
+
+namespace
+{
+    void *try_allocate(std::size_t size, std::size_t alignment) noexcept
+    {
+        // set up once, thread safe as a function-local static; the heap's
+        // own lock serialises every call after that
+        static const bool heap_ready = umeminit(UMEM_NEW_REGION_SIZE, UMEM_NEW_ALGO | UMEM_THREADED) == 0;
+        if (!heap_ready)
+        {
+            return nullptr;
+        }
+
+        // new must hand out a unique pointer even for 0 bytes
+        if (size == 0)
+        {
+            size = 1;
+        }
+        return alignment > 8 ? umemalign(alignment, size) : umalloc(size);
+    }
+
+    void *allocate(std::size_t size, std::size_t alignment)
+    {
+        for (;;)
+        {
+            void *ptr = try_allocate(size, alignment);
+            if (ptr != nullptr)
+            {
+                return ptr;
+            }
+
+            // give the new handler a chance to release memory, as the
+            // standard operator new does
+            std::new_handler handler = std::get_new_handler();
+            if (handler == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+            handler();
+        }
+    }
+
+    void *allocate_nothrow(std::size_t size, std::size_t alignment) noexcept
+    {
+        try
+        {
+            return allocate(size, alignment);
+        }
+        catch (...)
+        {
+            return nullptr;
+        }
+    }
+
+    void release(void *ptr) noexcept
+    {
+        if (ptr == nullptr)
+        {
+            return;
+        }
+        ufree(ptr);
+    }
+
+    void release_sized(void *ptr, std::size_t size) noexcept
+    {
+        if (ptr == nullptr)
+        {
+            return;
+        }
+        ufree_sized(ptr, size);
+    }
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// allocation
+//
+void *operator new(std::size_t size)
+{
+    return allocate(size, 0);
+}
+
+void *operator new[](std::size_t size)
+{
+    return allocate(size, 0);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate_nothrow(size, 0);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate_nothrow(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// deallocation : aligned blocks carry a normal header, so the alignment
+//                argument is not needed to free them
+//
+void operator delete(void *ptr) noexcept
+{
+    release(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    release(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    release(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    release(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size) noexcept
+{
+    release_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept
+{
+    release_sized(ptr, size);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    release(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    release(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    release(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    release(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size, std::align_val_t) noexcept
+{
+    release_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size, std::align_val_t) noexcept
+{
+    release_sized(ptr, size);
+}